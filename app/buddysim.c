@@ -0,0 +1,234 @@
+/*
+ * Offline fragmentation simulator.
+ *
+ * Streams an allocation trace written by buddy_trace_start through
+ * buddy_malloc and buddy_free on a pool of the traced size and flags,
+ * and reports how fragmentation develops. The pool is mapped with
+ * BUDDY_MAP_NORESERVE and no payload is ever written, so the only memory
+ * that gets touched is the free list links and headers at the start of
+ * blocks. That lets a large pool be simulated on a small machine. The
+ * trace is read in fixed size chunks and never held whole, so the tool
+ * handles traces of any length.
+ *
+ * Every interval operations it prints a line with:
+ *   op         records consumed so far
+ *   t_ms       trace time since the first record
+ *   live_req   bytes requested by live allocations
+ *   live_res   bytes of pool blocks reserved for them
+ *   int_frag   1 - live_req / live_res
+ *   ext_frag   1 - largest free block / free bytes, from buddy_stats
+ *   max_free_k order of the largest free block
+ *   failures   allocations that failed so far
+ * and a FAIL line for each failure up to -m of them, giving the request
+ * and the state of the pool when it could not be served.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/lab.h"
+#include "live.h"
+
+#define CHUNK 65536
+
+struct sim
+{
+    struct buddy_pool pool;
+    struct live live;
+    uint64_t ops;
+    uint64_t first_ns;
+    uint64_t live_req;
+    uint64_t failures;
+    uint64_t max_fail_lines;
+};
+
+static void report(struct sim *s, uint64_t ts_ns)
+{
+    struct buddy_stats st;
+    buddy_stats(&s->pool, &st);
+    printf("%12llu %10.1f %14llu %14zu %8.4f %8.4f %10zu %10llu\n",
+           (unsigned long long)s->ops, (double)(ts_ns - s->first_ns) / 1e6,
+           (unsigned long long)s->live_req, st.alloc_bytes,
+           st.alloc_bytes ? 1.0 - (double)s->live_req / (double)st.alloc_bytes : 0.0,
+           st.fragmentation, st.largest_free_k, (unsigned long long)s->failures);
+}
+
+static void failed(struct sim *s, const struct buddy_trace_record *r)
+{
+    if (s->failures++ >= s->max_fail_lines) {
+        return;
+    }
+    struct buddy_stats st;
+    buddy_stats(&s->pool, &st);
+    size_t hdr = (s->pool.flags & BUDDY_HEADERLESS) ? 0 : sizeof(struct avail);
+    printf("FAIL op=%llu size=%llu order=%zu max_free_k=%zu free=%zu ext_frag=%.4f\n",
+           (unsigned long long)s->ops, (unsigned long long)r->size, btok(r->size + hdr),
+           st.largest_free_k, st.free_bytes, st.fragmentation);
+}
+
+static void step(struct sim *s, const struct buddy_trace_record *r)
+{
+    void *ptr = NULL;
+    void *old = NULL;
+    uint64_t old_size = 0;
+    switch (r->op) {
+    case BUDDY_TRACE_MALLOC:
+    case BUDDY_TRACE_ALIGNED:
+        if (!r->id) {
+            return;
+        }
+        ptr = (r->op == BUDDY_TRACE_MALLOC) ? buddy_malloc(&s->pool, r->size)
+                                            : buddy_aligned_alloc(&s->pool, r->old_id, r->size);
+        break;
+    case BUDDY_TRACE_REALLOC:
+        old = r->old_id ? live_take(&s->live, r->old_id, &old_size) : NULL;
+        if (r->size && !r->id) {
+            if (old) live_put(&s->live, r->old_id, old, old_size);
+            return;
+        }
+        s->live_req -= old_size;
+        ptr = buddy_realloc(&s->pool, old, r->size);
+        if (!ptr && r->size && old) {
+            // The old block is still there
+            live_put(&s->live, r->old_id, old, old_size);
+            s->live_req += old_size;
+        }
+        break;
+    case BUDDY_TRACE_FREE:
+        old = live_take(&s->live, r->id, &old_size);
+        if (old) {
+            buddy_free(&s->pool, old);
+            s->live_req -= old_size;
+        }
+        return;
+    default:
+        return;
+    }
+
+    if (!r->id) {
+        return;
+    }
+    if (!ptr) {
+        failed(s, r);
+        return;
+    }
+    live_put(&s->live, r->id, ptr, r->size);
+    s->live_req += r->size;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i interval] [-m max-fail-lines] [-k pool-order] [-f flags] trace-file\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t interval = 1000000;
+    size_t pool_k = 0;
+    long flags = -1;
+    static struct sim s;
+    s.max_fail_lines = 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:m:k:f:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            s.max_fail_lines = strtoull(optarg, NULL, 0);
+            break;
+        case 'k':
+            pool_k = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            flags = strtol(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || interval == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const char *path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    struct buddy_trace_header hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) || hdr.magic != BUDDY_TRACE_MAGIC ||
+        hdr.version != BUDDY_TRACE_VERSION || hdr.record_size != sizeof(struct buddy_trace_record)) {
+        fprintf(stderr, "%s: not a version %d trace file\n", path, BUDDY_TRACE_VERSION);
+        return 1;
+    }
+
+    // A single thread replays the trace, so the concurrency machinery
+    // only gets in the way; the placement policy flags are kept
+    struct buddy_init_opts opts = {
+        .size = pool_k ? UINT64_C(1) << pool_k : hdr.pool_bytes,
+        .flags = (flags >= 0 ? (unsigned int)flags : hdr.flags) & ~(unsigned int)BUDDY_CONCURRENT,
+        .map = BUDDY_MAP_NORESERVE,
+    };
+    buddy_init_ex(&s.pool, &opts);
+    if (!s.pool.base) {
+        fprintf(stderr, "buddy_init: %s\n", strerror(errno));
+        return 1;
+    }
+    live_init(&s.live, 1024);
+
+    printf("trace %s: pool 2^%zu bytes, flags 0x%x\n", path, s.pool.kval_m, s.pool.flags);
+    printf("%12s %10s %14s %14s %8s %8s %10s %10s\n",
+           "op", "t_ms", "live_req", "live_res", "int_frag", "ext_frag", "max_free_k", "failures");
+
+    static struct buddy_trace_record buf[CHUNK];
+    uint64_t last_ts = 0;
+    size_t have = 0;
+    for (;;) {
+        ssize_t got = read(fd, (char *)buf + have, sizeof(buf) - have);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return 1;
+        }
+        have += (size_t)got;
+        size_t n = have / sizeof(buf[0]);
+        if (got == 0 && n == 0) {
+            break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (s.ops == 0) {
+                s.first_ns = buf[i].ts_ns;
+            }
+            step(&s, &buf[i]);
+            last_ts = buf[i].ts_ns;
+            if (++s.ops % interval == 0) {
+                report(&s, last_ts);
+            }
+        }
+
+        // Keep a trailing partial record for the next read
+        size_t used = n * sizeof(buf[0]);
+        memmove(buf, (char *)buf + used, have - used);
+        have -= used;
+        if (got == 0) {
+            break;
+        }
+    }
+    close(fd);
+    if (s.ops % interval) {
+        report(&s, last_ts);
+    }
+
+    live_destroy(&s.live);
+    buddy_destroy(&s.pool);
+    return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Live view of a pool in another process.
+ *
+ * Maps the shared memory page a pool publishes with buddy_publish_start
+ * read-only and redraws it every interval: usage, operation rates and
+ * purge state at the top, then one line per order that has any blocks
+ * with its free and reserved counts and how much of the order is in use.
+ * Each snapshot is copied out under the page's sequence count, so the
+ * process being watched is never stopped or made to wait.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../src/lab.h"
+
+#define BAR_WIDTH 40
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Copies a consistent snapshot out of the page, retrying for at most
+ * timeout_ns. A writer that died or was stopped halfway through an update
+ * leaves the sequence count odd for good, so this gives up and returns
+ * false with out left as it was.
+ */
+static bool read_page(const struct buddy_shm_page *page, struct buddy_shm_page *out, uint64_t timeout_ns)
+{
+    static struct buddy_shm_page tmp;
+    uint64_t deadline = now_ns() + timeout_ns;
+    do {
+        uint64_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(&tmp, page, sizeof(tmp));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+            memcpy(out, &tmp, sizeof(*out));
+            return true;
+        }
+    } while (now_ns() < deadline);
+    return false;
+}
+
+static const char *human(uint64_t bytes, char *buf, size_t len)
+{
+    static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double v = (double)bytes;
+    size_t u = 0;
+    while (v >= 1024.0 && u < 4) {
+        v /= 1024.0;
+        u++;
+    }
+    snprintf(buf, len, u ? "%.1f %s" : "%.0f %s", v, units[u]);
+    return buf;
+}
+
+static void draw(const struct buddy_shm_page *p, bool clear, bool stuck)
+{
+    const struct buddy_stats *st = &p->stats;
+    char a[32], b[32], c[32];
+
+    if (clear) {
+        printf("\033[H\033[J");
+    }
+    uint64_t age = now_ns() - p->updated_ns;
+    const char *state = "";
+    if (stuck || age > 3 * p->interval_ns) {
+        state = (kill(p->pid, 0) != 0 && errno == ESRCH) ? "  (process exited)" : "  (stale)";
+    }
+    printf("pid %d  pool %s  flags 0x%x  arenas %llu  snapshot %llu ms ago%s\n",
+           p->pid, human(p->pool_bytes, a, sizeof(a)), p->flags,
+           (unsigned long long)p->arenas, (unsigned long long)(age / 1000000), state);
+    printf("in use %s  peak %s  free %s  ext_frag %.4f  int_frag %.4f\n",
+           human(st->alloc_bytes, a, sizeof(a)), human(st->peak_bytes, b, sizeof(b)),
+           human(st->free_bytes, c, sizeof(c)), st->fragmentation,
+           st->live_reserved_bytes
+               ? 1.0 - (double)st->live_requested_bytes / (double)st->live_reserved_bytes : 0.0);
+    printf("malloc/s %.0f  free/s %.0f  failures %zu  splits %zu  coalesces %zu\n",
+           p->malloc_rate, p->free_rate, st->failures, st->splits, st->coalesces);
+    if (p->purge_k) {
+        printf("purge k>=%llu after %llu ms  resident %s  purged %s  purged total %s\n",
+               (unsigned long long)p->purge_k, (unsigned long long)(p->purge_decay_ns / 1000000),
+               human(p->purge.resident_bytes, a, sizeof(a)), human(p->purge.purged_bytes, b, sizeof(b)),
+               human(p->purge.purged_total, c, sizeof(c)));
+    } else {
+        printf("purge off  resident %s\n", human(p->purge.resident_bytes, a, sizeof(a)));
+    }
+
+    printf("\n%5s %10s %10s %10s %6s  %s\n", "order", "size", "free", "reserved", "used%", "occupancy");
+    for (size_t k = SMALLEST_K; k < MAX_K; k++) {
+        size_t total = st->free_blocks[k] + st->alloc_blocks[k];
+        if (!total) {
+            continue;
+        }
+        double used = (double)st->alloc_blocks[k] / (double)total;
+        int fill = (int)(used * BAR_WIDTH + 0.5);
+        printf("%5zu %10s %10zu %10zu %6.1f  %.*s%.*s\n", k,
+               human(UINT64_C(1) << k, a, sizeof(a)), st->free_blocks[k], st->alloc_blocks[k],
+               100.0 * used, fill, "########################################",
+               BAR_WIDTH - fill, "........................................");
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i interval-ms] [-n count] pid|/shm-name\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long interval_ms = 0;
+    unsigned long count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char name[64];
+    if (argv[optind][0] == '/') {
+        snprintf(name, sizeof(name), "%s", argv[optind]);
+    } else {
+        snprintf(name, sizeof(name), BUDDY_SHM_PREFIX "%s", argv[optind]);
+    }
+    int fd = shm_open(name, O_RDONLY, 0);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    if ((size_t)sb.st_size < sizeof(struct buddy_shm_page)) {
+        fprintf(stderr, "%s: not a buddy stats page\n", name);
+        return 1;
+    }
+    const struct buddy_shm_page *page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != BUDDY_SHM_MAGIC ||
+        page->version != BUDDY_SHM_VERSION || page->page_size != sizeof(struct buddy_shm_page)) {
+        fprintf(stderr, "%s: not a version %d buddy stats page\n", name, BUDDY_SHM_VERSION);
+        return 1;
+    }
+    if (!interval_ms) {
+        interval_ms = (unsigned long)(page->interval_ns / 1000000);
+    }
+
+    // Until the first good read there is nothing better to show than the
+    // page as it stands
+    bool clear = isatty(STDOUT_FILENO);
+    struct buddy_shm_page snap;
+    memcpy(&snap, page, sizeof(snap));
+    for (unsigned long i = 0; count == 0 || i < count; i++) {
+        if (i) {
+            struct timespec nap = { (time_t)(interval_ms / 1000), (long)(interval_ms % 1000) * 1000000 };
+            nanosleep(&nap, NULL);
+        }
+        bool fresh = read_page(page, &snap, (uint64_t)interval_ms * 1000000);
+        draw(&snap, clear, !fresh);
+    }
+    munmap((void *)page, sizeof(*page));
+    return 0;
+}
@@ -0,0 +1,118 @@
+#ifndef LIVE_H
+#define LIVE_H
+
+/*
+ * Live objects of a replayed trace by trace id, shared by the tools in
+ * app/. Open addressing with linear probing and backward shift deletion
+ * so there are no tombstones; the table doubles once it is half full.
+ * Each entry keeps the pointer the tool got for the id and the size that
+ * was asked for.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct live
+{
+    uint64_t *ids;              /*0 marks an empty slot*/
+    void **ptrs;
+    uint64_t *sizes;
+    size_t mask;
+    size_t count;
+};
+
+static inline size_t live_home(const struct live *l, uint64_t id)
+{
+    return (size_t)((id * UINT64_C(0x9e3779b97f4a7c15)) >> 20) & l->mask;
+}
+
+static inline size_t live_slot(const struct live *l, uint64_t id)
+{
+    size_t i = live_home(l, id);
+    while (l->ids[i] && l->ids[i] != id) {
+        i = (i + 1) & l->mask;
+    }
+    return i;
+}
+
+/* cap must be a power of two */
+static inline void live_init(struct live *l, size_t cap)
+{
+    l->mask = cap - 1;
+    l->count = 0;
+    l->ids = calloc(cap, sizeof(uint64_t));
+    l->ptrs = calloc(cap, sizeof(void *));
+    l->sizes = calloc(cap, sizeof(uint64_t));
+    if (!l->ids || !l->ptrs || !l->sizes) {
+        perror("calloc");
+        exit(1);
+    }
+}
+
+static inline void live_destroy(struct live *l)
+{
+    free(l->ids);
+    free(l->ptrs);
+    free(l->sizes);
+}
+
+static inline void live_put(struct live *l, uint64_t id, void *ptr, uint64_t size)
+{
+    if (2 * (l->count + 1) > l->mask + 1) {
+        struct live bigger;
+        live_init(&bigger, 2 * (l->mask + 1));
+        for (size_t i = 0; i <= l->mask; i++) {
+            if (l->ids[i]) {
+                size_t j = live_slot(&bigger, l->ids[i]);
+                bigger.ids[j] = l->ids[i];
+                bigger.ptrs[j] = l->ptrs[i];
+                bigger.sizes[j] = l->sizes[i];
+                bigger.count++;
+            }
+        }
+        live_destroy(l);
+        *l = bigger;
+    }
+    size_t i = live_slot(l, id);
+    if (!l->ids[i]) {
+        l->count++;
+    }
+    l->ids[i] = id;
+    l->ptrs[i] = ptr;
+    l->sizes[i] = size;
+}
+
+/* Removes id and returns its pointer, NULL if it is not live */
+static inline void *live_take(struct live *l, uint64_t id, uint64_t *size)
+{
+    size_t i = live_slot(l, id);
+    if (!l->ids[i]) {
+        return NULL;
+    }
+    void *ptr = l->ptrs[i];
+    if (size) {
+        *size = l->sizes[i];
+    }
+    l->ids[i] = 0;
+    l->count--;
+
+    // Pull later entries of the probe run back over the hole
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & l->mask;
+        if (!l->ids[j]) {
+            break;
+        }
+        size_t home = live_home(l, l->ids[j]);
+        if (((j - home) & l->mask) >= ((j - i) & l->mask)) {
+            l->ids[i] = l->ids[j];
+            l->ptrs[i] = l->ptrs[j];
+            l->sizes[i] = l->sizes[j];
+            l->ids[j] = 0;
+            i = j;
+        }
+    }
+    return ptr;
+}
+
+#endif
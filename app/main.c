@@ -1,7 +1,393 @@
+/*
+ * Trace replay driver.
+ *
+ * Replays an allocation trace written by buddy_trace_start against a
+ * buddy pool and against glibc malloc, each in a child process of its own
+ * so peak RSS is not shared. Every allocator replays the trace twice: an
+ * untimed pass for throughput and a pass timing each call for the latency
+ * percentiles, which include the cost of reading the clock. Each pass
+ * touches the first byte of every block it gets. Fragmentation is taken
+ * at the end of the timed pass, with whatever the trace left live:
+ *   buddy   external fragmentation from buddy_stats and internal
+ *           fragmentation, 1 - bytes the live objects asked for / bytes
+ *           of the blocks and slab objects reserved for them
+ *   malloc  free bytes held in the heap over the heap size, from mallinfo2
+ * The trace is read in fixed size chunks, as buddysim does, so its size
+ * does not show up in either child's peak RSS.
+ *
+ * Build without sanitizers for meaningful numbers, see README.md.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../src/lab.h"
+#include "live.h"
 
-int main(void)
+#define CHUNK 65536
+
+/*
+ * Latency histogram, log-linear: values below 2^HIST_SUB_BITS ns get a
+ * bucket each, above that every power of two is split into 2^HIST_SUB_BITS
+ * buckets, so a percentile is off by at most 1/16 of its value.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct hist
+{
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total;
+};
+
+static size_t hist_bucket(uint64_t v)
+{
+    if (v < HIST_SUB) {
+        return (size_t)v;
+    }
+    unsigned int e = 63 - (unsigned int)__builtin_clzll(v);
+    return (size_t)(e - HIST_SUB_BITS + 1) * HIST_SUB + (size_t)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Lower bound of bucket b */
+static uint64_t hist_value(size_t b)
+{
+    if (b < HIST_SUB) {
+        return b;
+    }
+    unsigned int e = (unsigned int)(b / HIST_SUB) + HIST_SUB_BITS - 1;
+    return (UINT64_C(1) << e) | ((uint64_t)(b % HIST_SUB) << (e - HIST_SUB_BITS));
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+    uint64_t want = (uint64_t)(p * (double)h->total);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen > want) {
+            return hist_value(b);
+        }
+    }
+    return 0;
+}
+
+/*
+ * The allocator under test. pool is NULL for glibc malloc.
+ */
+struct target
+{
+    const char *name;
+    struct buddy_pool *pool;
+};
+
+static void *t_malloc(struct target *t, size_t size)
+{
+    return t->pool ? buddy_malloc(t->pool, size) : malloc(size);
+}
+
+static void *t_aligned(struct target *t, size_t alignment, size_t size)
+{
+    if (t->pool) {
+        return buddy_aligned_alloc(t->pool, alignment, size);
+    }
+    void *ptr = NULL;
+    return posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *) : alignment, size) ? NULL : ptr;
+}
+
+static void *t_realloc(struct target *t, void *ptr, size_t size)
+{
+    return t->pool ? buddy_realloc(t->pool, ptr, size) : realloc(ptr, size);
+}
+
+static void t_free(struct target *t, void *ptr)
+{
+    if (t->pool) {
+        buddy_free(t->pool, ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+struct replay
+{
+    uint64_t ops;               /*Calls replayed*/
+    uint64_t failures;          /*Allocations that failed here but not in the trace*/
+    uint64_t skipped;           /*Failed in the trace, or free of an id never seen*/
+    uint64_t live_req;          /*Bytes asked for by the objects left live*/
+    uint64_t ns;                /*Time spent replaying, reading the trace not included*/
+};
+
+/*
+ * Replays one record, timing the call into h when it is not NULL. Live
+ * objects are kept in l with the size they asked for.
+ */
+static void replay_one(struct target *t, const struct buddy_trace_record *r,
+                       struct live *l, struct hist *h, struct replay *out)
+{
+    void *ptr = NULL;
+    void *old = NULL;
+    uint64_t old_size = 0;
+    uint64_t start = h ? now_ns() : 0;
+    switch (r->op) {
+    case BUDDY_TRACE_MALLOC:
+        if (!r->id) {
+            out->skipped++;
+            return;
+        }
+        ptr = t_malloc(t, r->size);
+        break;
+    case BUDDY_TRACE_ALIGNED:
+        if (!r->id) {
+            out->skipped++;
+            return;
+        }
+        ptr = t_aligned(t, r->old_id, r->size);
+        break;
+    case BUDDY_TRACE_REALLOC:
+        old = r->old_id ? live_take(l, r->old_id, &old_size) : NULL;
+        if (r->size && !r->id) {
+            // Failed in the trace, the old block stayed live
+            if (old) live_put(l, r->old_id, old, old_size);
+            out->skipped++;
+            return;
+        }
+        out->live_req -= old_size;
+        if (h) start = now_ns();
+        ptr = t_realloc(t, old, r->size);
+        break;
+    case BUDDY_TRACE_FREE:
+        old = live_take(l, r->id, &old_size);
+        if (!old) {
+            out->skipped++;
+            return;
+        }
+        out->live_req -= old_size;
+        if (h) start = now_ns();
+        t_free(t, old);
+        break;
+    default:
+        out->skipped++;
+        return;
+    }
+    if (h) {
+        h->count[hist_bucket(now_ns() - start)]++;
+        h->total++;
+    }
+    out->ops++;
+
+    if (r->op != BUDDY_TRACE_FREE && r->id) {
+        if (!ptr) {
+            // A failed realloc leaves the old block where it was
+            if (old) {
+                live_put(l, r->old_id, old, old_size);
+                out->live_req += old_size;
+            }
+            out->failures++;
+            return;
+        }
+        *(volatile char *)ptr = 0;
+        live_put(l, r->id, ptr, r->size);
+        out->live_req += r->size;
+    }
+}
+
+/*
+ * Replays every record of the trace open on fd, read from just past the
+ * header a chunk at a time. Returns 0, or -1 when the trace cannot be read.
+ */
+static int replay(struct target *t, int fd, struct live *l, struct hist *h, struct replay *out)
+{
+    static struct buddy_trace_record buf[CHUNK];
+    memset(out, 0, sizeof(*out));
+    if (lseek(fd, sizeof(struct buddy_trace_header), SEEK_SET) < 0) {
+        perror("lseek");
+        return -1;
+    }
+    size_t have = 0;
+    for (;;) {
+        ssize_t got = read(fd, (char *)buf + have, sizeof(buf) - have);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        }
+        have += (size_t)got;
+        size_t n = have / sizeof(buf[0]);
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            replay_one(t, &buf[i], l, h, out);
+        }
+        out->ns += now_ns() - start;
+
+        // Keep a trailing partial record for the next read
+        size_t used = n * sizeof(buf[0]);
+        memmove(buf, (char *)buf + used, have - used);
+        have -= used;
+        if (got == 0) {
+            return 0;
+        }
+    }
+}
+
+static void free_all(struct target *t, struct live *l)
+{
+    for (size_t i = 0; i <= l->mask; i++) {
+        if (l->ids[i]) {
+            t_free(t, l->ptrs[i]);
+            l->ids[i] = 0;
+        }
+    }
+    l->count = 0;
+}
+
+static int run(const char *name, const struct buddy_trace_header *hdr, int fd)
+{
+    struct buddy_pool pool;
+    struct target t = { name, NULL };
+    if (strcmp(name, "buddy") == 0) {
+        buddy_init_flags(&pool, hdr->pool_bytes, hdr->flags);
+        if (!pool.base) {
+            fprintf(stderr, "buddy_init: %s\n", strerror(errno));
+            return 1;
+        }
+        t.pool = &pool;
+    }
+
+    struct live l;
+    live_init(&l, 1024);
+    struct replay r;
+    if (replay(&t, fd, &l, NULL, &r) != 0) {
+        return 1;
+    }
+    double secs = (double)r.ns / 1e9;
+    free_all(&t, &l);
+
+    static struct hist h;
+    if (replay(&t, fd, &l, &h, &r) != 0) {
+        return 1;
+    }
+
+    double ext = 0.0;
+    double internal = 0.0;
+    if (t.pool) {
+        struct buddy_stats st;
+        buddy_stats(t.pool, &st);
+        ext = st.fragmentation;
+        internal = st.live_reserved_bytes ? 1.0 - (double)r.live_req / (double)st.live_reserved_bytes : 0.0;
+    } else {
+        struct mallinfo2 mi = mallinfo2();
+        ext = mi.arena ? (double)mi.fordblks / (double)mi.arena : 0.0;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("%-8s %12llu %14.0f %8llu %8llu %8llu %12ld %8.4f %8.4f %10llu %10llu\n",
+           name, (unsigned long long)r.ops, (double)r.ops / secs,
+           (unsigned long long)hist_percentile(&h, 0.50),
+           (unsigned long long)hist_percentile(&h, 0.99),
+           (unsigned long long)hist_percentile(&h, 0.999),
+           ru.ru_maxrss, ext, internal,
+           (unsigned long long)r.failures, (unsigned long long)r.skipped);
+    fflush(stdout);
+    free_all(&t, &l);
+    live_destroy(&l);
+    if (t.pool) {
+        buddy_destroy(t.pool);
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-a buddy|malloc|both] trace-file\n", prog);
+}
+
+int myMain(int argc, char **argv)
+{
+    const char *which = "both";
+    int opt;
+    while ((opt = getopt(argc, argv, "a:h")) != -1) {
+        switch (opt) {
+        case 'a':
+            which = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 ||
+        (strcmp(which, "buddy") && strcmp(which, "malloc") && strcmp(which, "both"))) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // Only the header is read here, each child streams the records
+    const char *path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        perror(path);
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    struct buddy_trace_header hdr;
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) || hdr.magic != BUDDY_TRACE_MAGIC ||
+        hdr.version != BUDDY_TRACE_VERSION || hdr.record_size != sizeof(struct buddy_trace_record)) {
+        fprintf(stderr, "%s: not a version %d trace file\n", path, BUDDY_TRACE_VERSION);
+        return 1;
+    }
+    size_t n = ((size_t)sb.st_size - sizeof(hdr)) / sizeof(struct buddy_trace_record);
+
+    printf("trace %s: %zu records, pool 2^%zu bytes, flags 0x%x\n",
+           path, n, btok(hdr.pool_bytes), hdr.flags);
+    printf("%-8s %12s %14s %8s %8s %8s %12s %8s %8s %10s %10s\n",
+           "alloc", "ops", "ops/s", "p50_ns", "p99_ns", "p999_ns", "maxrss_kb",
+           "ext_frag", "int_frag", "failures", "skipped");
+    fflush(stdout);
+
+    // Each allocator gets a fresh process so maxrss is its own
+    static const char *const names[] = { "buddy", "malloc" };
+    int status = 0;
+    for (size_t i = 0; i < 2; i++) {
+        if (strcmp(which, "both") && strcmp(which, names[i])) {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            exit(run(names[i], &hdr, fd));
+        }
+        int child;
+        waitpid(pid, &child, 0);
+        if (!WIFEXITED(child) || WEXITSTATUS(child) != 0) {
+            status = 1;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+int main(int argc, char **argv)
 {
-  printf("hello world\n");
-  return 0;
+    return myMain(argc, argv);
 }
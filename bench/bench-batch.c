@@ -0,0 +1,99 @@
+/*
+ * Batch allocation and free against one call per object.
+ *
+ * Allocates n same-sized objects from a fresh pool, either with
+ * buddy_malloc_batch or with n calls to buddy_malloc, then frees them all
+ * either one by one or with buddy_free_batch. The pool starts as one big
+ * free block each round, so single calls pay for a split cascade on the
+ * first object while the batch splits once for all of them, and on the
+ * way back every single free walks its own coalesce chain. Frees are
+ * handed back in a shuffled order, the way request-scoped objects die.
+ * Times are per object.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define ROUNDS 20000
+#define MAX_N 256
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+struct timing
+{
+    double alloc;
+    double free;
+};
+
+static struct timing run(struct buddy_pool *pool, size_t size, size_t n, bool batch)
+{
+    void *ptrs[MAX_N];
+    struct timing t = { 0, 0 };
+    unsigned seed = 1;
+    for (int r = 0; r < ROUNDS; r++) {
+        double start = now_ns();
+        if (batch) {
+            if (buddy_malloc_batch(pool, size, n, ptrs) != n) {
+                perror("buddy_malloc_batch");
+                exit(1);
+            }
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                ptrs[i] = buddy_malloc(pool, size);
+            }
+        }
+        t.alloc += now_ns() - start;
+
+        for (size_t i = n - 1; i > 0; i--) {
+            size_t j = (size_t)rand_r(&seed) % (i + 1);
+            void *tmp = ptrs[i];
+            ptrs[i] = ptrs[j];
+            ptrs[j] = tmp;
+        }
+
+        start = now_ns();
+        if (batch) {
+            buddy_free_batch(pool, ptrs, n);
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                buddy_free(pool, ptrs[i]);
+            }
+        }
+        t.free += now_ns() - start;
+    }
+    t.alloc /= (double)ROUNDS * (double)n;
+    t.free /= (double)ROUNDS * (double)n;
+    return t;
+}
+
+int main(void)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << DEFAULT_K);
+    if (!pool.base) {
+        perror("buddy_init");
+        return 1;
+    }
+
+    size_t sizes[] = { 40, 200, 1000 };
+    size_t counts[] = { 8, 64, 256 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+            struct timing single = run(&pool, sizes[s], counts[c], false);
+            struct timing batch = run(&pool, sizes[s], counts[c], true);
+            printf("size=%-5zu n=%-3zu malloc single %7.2f batch %7.2f ns/obj %.2fx"
+                   "  free single %7.2f batch %7.2f ns/obj %.2fx\n",
+                   sizes[s], counts[c], single.alloc, batch.alloc, single.alloc / batch.alloc,
+                   single.free, batch.free, single.free / batch.free);
+        }
+    }
+
+    buddy_destroy(&pool);
+    return 0;
+}
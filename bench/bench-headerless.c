@@ -0,0 +1,72 @@
+/*
+ * Memory efficiency of headered against headerless allocations.
+ *
+ * Runs the same mixed-size workload on a default pool and on a
+ * BUDDY_HEADERLESS pool: half the requests are exact powers of two from
+ * 16 bytes to 64 KiB, the other half are uniformly random sizes in the
+ * same range. It reports how many bytes were requested against how many
+ * the pool reserved to satisfy them, and how many requests fit before the
+ * pool ran out.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/lab.h"
+
+#define POOL_K 28
+#define MAX_ALLOCS 200000
+
+static size_t next_size(unsigned *seed)
+{
+    if (rand_r(seed) & 1) {
+        return (size_t)1 << (4 + rand_r(seed) % 13);
+    }
+    return (size_t)(rand_r(seed) % (1 << 16)) + 1;
+}
+
+static size_t free_bytes(struct buddy_pool *pool)
+{
+    size_t total = 0;
+    for (size_t k = 0; k <= pool->kval_m; k++) {
+        for (struct avail *b = pool->avail[k].next; b != &pool->avail[k]; b = b->next) {
+            total += (size_t)1 << k;
+        }
+    }
+    return total;
+}
+
+static void report(const char *name, unsigned int flags)
+{
+    static void *ptrs[MAX_ALLOCS];
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, (size_t)1 << POOL_K, flags);
+
+    unsigned seed = 42;
+    size_t requested = 0;
+    size_t count = 0;
+    while (count < MAX_ALLOCS) {
+        size_t size = next_size(&seed);
+        void *p = buddy_malloc(&pool, size);
+        if (!p) {
+            break;
+        }
+        ptrs[count++] = p;
+        requested += size;
+    }
+
+    size_t reserved = pool.numbytes - free_bytes(&pool);
+    printf("%-12s allocs=%zu requested=%zu reserved=%zu efficiency=%.1f%%\n",
+           name, count, requested, reserved, 100.0 * (double)requested / (double)reserved);
+
+    for (size_t i = 0; i < count; i++) {
+        buddy_free(&pool, ptrs[i]);
+    }
+    buddy_destroy(&pool);
+}
+
+int main(void)
+{
+    printf("mixed-size workload on a 2^%d pool, filled until ENOMEM\n", POOL_K);
+    report("headered", 0);
+    report("headerless", BUDDY_HEADERLESS);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Eager against lazy coalescing.
+ *
+ * The ping-pong pattern allocates and frees one block of a fixed size in
+ * a tight loop. An eager pool merges the block all the way back up on
+ * every free and splits it back down on the next malloc, a BUDDY_LAZY
+ * pool parks it and hands it straight back. The burst pattern allocates
+ * BURST blocks of one size and frees them all, which is where the
+ * high-water mark kicks in.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define POOL_K 24
+#define ROUNDS 2000000
+#define BURST 256
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double ping_pong(unsigned int flags, size_t size)
+{
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, (size_t)1 << POOL_K, flags);
+
+    double start = now();
+    for (int i = 0; i < ROUNDS; i++) {
+        void *p = buddy_malloc(&pool, size);
+        buddy_free(&pool, p);
+    }
+    double ns = (now() - start) * 1e9 / ROUNDS;
+    buddy_destroy(&pool);
+    return ns;
+}
+
+static double burst(unsigned int flags, size_t size)
+{
+    static void *ptrs[BURST];
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, (size_t)1 << POOL_K, flags);
+
+    int rounds = ROUNDS / BURST;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < BURST; i++) {
+            ptrs[i] = buddy_malloc(&pool, size);
+        }
+        for (int i = 0; i < BURST; i++) {
+            buddy_free(&pool, ptrs[i]);
+        }
+    }
+    double ns = (now() - start) * 1e9 / ((double)rounds * BURST);
+    buddy_destroy(&pool);
+    return ns;
+}
+
+int main(void)
+{
+    static const size_t sizes[] = {16, 1000, 60000};
+    printf("ns per malloc/free pair on a 2^%d pool\n", POOL_K);
+    printf("%-10s %8s %8s %8s %8s\n", "size", "pp-eager", "pp-lazy", "bu-eager", "bu-lazy");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        printf("%-10zu %8.1f %8.1f %8.1f %8.1f\n", sizes[i],
+               ping_pong(0, sizes[i]), ping_pong(BUDDY_LAZY, sizes[i]),
+               burst(0, sizes[i]), burst(BUDDY_LAZY, sizes[i]));
+    }
+    return 0;
+}
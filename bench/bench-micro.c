@@ -0,0 +1,202 @@
+/*
+ * Microbenchmark suite.
+ *
+ * Times the basic operations of a default pool one pattern at a time:
+ *   pair/k=N       buddy_malloc + buddy_free of one order-N block in a loop,
+ *                  for every order from SMALLEST_K up to the whole pool
+ *   pair+lat/k=N   the same with buddy_latency_start timing every call
+ *   random         malloc or free on a random slot, random sizes
+ *   random+prof    the same with the heap profiler at its default rate
+ *   lifo/fifo/rand SLOTS random sized blocks, freed newest first, oldest
+ *                  first or in random order
+ *   realloc/+N     a block grown N bytes at a time from 16 bytes to 1 MiB
+ *   init/k=N       buddy_init + buddy_destroy of a 2^N pool
+ *
+ * Every result is the best of RUNS runs. Output is one line per
+ * benchmark, "name ns_per_op ops_per_sec", after a header line starting
+ * with '#', so runs from different commits can be diffed or joined.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define POOL_K 28
+#define RUNS 3
+#define PAIR_OPS 1000000
+#define RANDOM_OPS 1000000
+#define SLOTS 4096
+#define MAX_SIZE 4096
+
+static void *slots[SLOTS];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char *name, double best_ns, double ops)
+{
+    double per_op = best_ns / ops;
+    printf("%-20s %10.2f %14.0f\n", name, per_op, 1e9 / per_op);
+}
+
+static double pair(struct buddy_pool *pool, size_t size)
+{
+    double start = now_ns();
+    for (int i = 0; i < PAIR_OPS; i++) {
+        buddy_free(pool, buddy_malloc(pool, size));
+    }
+    return now_ns() - start;
+}
+
+static double random_ops(struct buddy_pool *pool)
+{
+    unsigned seed = 42;
+    double start = now_ns();
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        int s = rand_r(&seed) % SLOTS;
+        if (slots[s]) {
+            buddy_free(pool, slots[s]);
+            slots[s] = NULL;
+        } else {
+            slots[s] = buddy_malloc(pool, (size_t)(rand_r(&seed) % MAX_SIZE) + 1);
+        }
+    }
+    double elapsed = now_ns() - start;
+    for (int s = 0; s < SLOTS; s++) {
+        buddy_free(pool, slots[s]);
+        slots[s] = NULL;
+    }
+    return elapsed;
+}
+
+/* order is 0 for LIFO, 1 for FIFO and 2 for random */
+static double free_order(struct buddy_pool *pool, int order)
+{
+    static int perm[SLOTS];
+    unsigned seed = 7;
+    for (int i = 0; i < SLOTS; i++) {
+        perm[i] = (order == 0) ? SLOTS - 1 - i : i;
+    }
+    for (int i = SLOTS - 1; order == 2 && i > 0; i--) {
+        int j = rand_r(&seed) % (i + 1);
+        int tmp = perm[i];
+        perm[i] = perm[j];
+        perm[j] = tmp;
+    }
+
+    double start = now_ns();
+    for (int i = 0; i < SLOTS; i++) {
+        slots[i] = buddy_malloc(pool, (size_t)(rand_r(&seed) % MAX_SIZE) + 1);
+    }
+    for (int i = 0; i < SLOTS; i++) {
+        buddy_free(pool, slots[perm[i]]);
+    }
+    return now_ns() - start;
+}
+
+static double realloc_chain(struct buddy_pool *pool, size_t step, double *ops)
+{
+    double start = now_ns();
+    void *p = buddy_malloc(pool, 16);
+    *ops = 2;
+    for (size_t size = 16 + step; size <= (1 << 20); size += step) {
+        p = buddy_realloc(pool, p, size);
+        *ops += 1;
+    }
+    buddy_free(pool, p);
+    return now_ns() - start;
+}
+
+static double init_destroy(size_t k, int reps)
+{
+    struct buddy_pool pool;
+    double start = now_ns();
+    for (int i = 0; i < reps; i++) {
+        buddy_init(&pool, (size_t)1 << k);
+        buddy_destroy(&pool);
+    }
+    return now_ns() - start;
+}
+
+static double best(double a, double b)
+{
+    return (b < a) ? b : a;
+}
+
+int main(void)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, (size_t)1 << POOL_K);
+    char name[32];
+
+    printf("# name ns_per_op ops_per_sec\n");
+    for (size_t k = SMALLEST_K; k <= POOL_K; k++) {
+        double t = 1e300;
+        for (int r = 0; r < RUNS; r++) {
+            t = best(t, pair(&pool, ((size_t)1 << k) - sizeof(struct avail)));
+        }
+        snprintf(name, sizeof(name), "pair/k=%zu", k);
+        report(name, t, 2.0 * PAIR_OPS);
+    }
+    if (buddy_latency_start(&pool) == 0) {
+        for (size_t k = SMALLEST_K; k <= POOL_K; k++) {
+            double t = 1e300;
+            for (int r = 0; r < RUNS; r++) {
+                t = best(t, pair(&pool, ((size_t)1 << k) - sizeof(struct avail)));
+            }
+            snprintf(name, sizeof(name), "pair+lat/k=%zu", k);
+            report(name, t, 2.0 * PAIR_OPS);
+        }
+        buddy_latency_stop(&pool);
+    }
+
+    double t = 1e300;
+    for (int r = 0; r < RUNS; r++) {
+        t = best(t, random_ops(&pool));
+    }
+    report("random", t, RANDOM_OPS);
+    if (buddy_heap_profile_start(&pool, 0) == 0) {
+        t = 1e300;
+        for (int r = 0; r < RUNS; r++) {
+            t = best(t, random_ops(&pool));
+        }
+        report("random+prof", t, RANDOM_OPS);
+        buddy_heap_profile_stop(&pool);
+    }
+
+    static const char *const orders[] = { "lifo", "fifo", "rand" };
+    for (int o = 0; o < 3; o++) {
+        t = 1e300;
+        for (int r = 0; r < RUNS * 10; r++) {
+            t = best(t, free_order(&pool, o));
+        }
+        report(orders[o], t, 2.0 * SLOTS);
+    }
+
+    static const size_t steps[] = { 16, 256, 4096 };
+    for (int s = 0; s < 3; s++) {
+        double ops = 0;
+        t = 1e300;
+        for (int r = 0; r < RUNS; r++) {
+            t = best(t, realloc_chain(&pool, steps[s], &ops));
+        }
+        snprintf(name, sizeof(name), "realloc/+%zu", steps[s]);
+        report(name, t, ops);
+    }
+    buddy_destroy(&pool);
+
+    static const size_t init_k[] = { MIN_K, 24, DEFAULT_K };
+    for (int i = 0; i < 3; i++) {
+        t = 1e300;
+        for (int r = 0; r < RUNS; r++) {
+            t = best(t, init_destroy(init_k[i], 100));
+        }
+        snprintf(name, sizeof(name), "init/k=%zu", init_k[i]);
+        report(name, t, 100);
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Microbenchmark for the free-block search in buddy_malloc.
+ *
+ * Builds a nearly exhausted pool where the only free memory sits in one
+ * large block, so every small request has to look past dozens of empty
+ * orders. It times the old one-order-at-a-time walk over pool->avail
+ * against the count-trailing-zeros lookup on pool->avail_bits, and then
+ * the end to end cost of a malloc/free pair on the same pool.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define ITERATIONS 10000000UL
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* The search buddy_malloc did before the order bitmap existed */
+static size_t search_linear(struct buddy_pool *pool, size_t k)
+{
+    for (size_t i = k; i <= pool->kval_m; i++) {
+        if (pool->avail[i].next != &pool->avail[i]) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static size_t search_bitmap(struct buddy_pool *pool, size_t k)
+{
+    uint64_t candidates = pool->avail_bits & (~UINT64_C(0) << k);
+    return candidates ? (size_t)__builtin_ctzll(candidates) : 0;
+}
+
+static void bench_search(struct buddy_pool *pool, const char *name,
+                         size_t (*search)(struct buddy_pool *, size_t))
+{
+    volatile size_t sink = 0;
+    double start = now_ns();
+    for (unsigned long i = 0; i < ITERATIONS; i++) {
+        /* Vary the order a little so the loop cannot be hoisted */
+        sink += search(pool, SMALLEST_K + (i & 3));
+    }
+    double elapsed = now_ns() - start;
+    printf("%-28s %8.2f ns/op\n", name, elapsed / ITERATIONS);
+    (void)sink;
+}
+
+static void bench_malloc_free(struct buddy_pool *pool, const char *name)
+{
+    double start = now_ns();
+    for (unsigned long i = 0; i < ITERATIONS; i++) {
+        void *p = buddy_malloc(pool, 1);
+        buddy_free(pool, p);
+    }
+    double elapsed = now_ns() - start;
+    printf("%-28s %8.2f ns/op\n", name, elapsed / ITERATIONS);
+}
+
+int main(void)
+{
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << DEFAULT_K);
+    if (!pool.base) {
+        perror("buddy_init");
+        return 1;
+    }
+
+    /* Reserve the lower half so only one order-29 block is left free */
+    void *half = buddy_malloc(&pool, (UINT64_C(1) << (DEFAULT_K - 1)) - sizeof(struct avail));
+    if (!half) {
+        perror("buddy_malloc");
+        return 1;
+    }
+
+    printf("fragmented 2^%d pool, free orders mask 0x%llx\n", DEFAULT_K,
+           (unsigned long long)pool.avail_bits);
+    bench_search(&pool, "search linear walk", search_linear);
+    bench_search(&pool, "search order bitmap", search_bitmap);
+    bench_malloc_free(&pool, "malloc+free pair (1 byte)");
+
+    buddy_free(&pool, half);
+    buddy_destroy(&pool);
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Throughput of a shared pool as the thread count grows.
+ *
+ * Three workloads, each run with 1 up to MAX_THREADS threads:
+ *   private   every thread allocates and frees its own blocks
+ *   prodcons  threads are paired up, one allocates and hands each block
+ *             through a queue to the other, which frees it
+ *   larson    threads replace random entries of one shared array, freeing
+ *             whatever another thread put there
+ *
+ * and against each way the pool can be shared: a plain pool with every
+ * call wrapped in one global mutex, which is what callers had to do
+ * before, or a BUDDY_CONCURRENT pool with per-order locks, alone or with
+ * thread caches, slabs or lazy coalescing in front.
+ *
+ * Besides ops/sec each line breaks contention down: waits on the global
+ * mutex, or on the order locks per thousand operations, the three orders
+ * that were waited on most and how often an allocation had to yield for
+ * a split or merge in flight. The order lock counters come from
+ * buddy_stats and read 0 when BUDDY_STATS is compiled out.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define OPS_PER_THREAD 200000
+#define SLOTS 64
+#define MAX_THREADS 8
+#define QUEUE_SIZE 256
+#define LARSON_SLOTS 1024
+#define MAX_SIZE 1024
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t global_waits;
+
+struct worker
+{
+    struct buddy_pool *pool;
+    bool use_global_lock;
+    unsigned seed;
+    struct queue *queue;        /*prodcons only*/
+    bool producer;
+    void **shared;              /*larson only*/
+    size_t nshared;
+};
+
+/* Single producer single consumer queue of blocks */
+struct queue
+{
+    void *items[QUEUE_SIZE];
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void lock(struct worker *w)
+{
+    if (w->use_global_lock && pthread_mutex_trylock(&global_lock) != 0) {
+        __atomic_fetch_add(&global_waits, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&global_lock);
+    }
+}
+
+static void unlock(struct worker *w)
+{
+    if (w->use_global_lock) pthread_mutex_unlock(&global_lock);
+}
+
+static void *do_malloc(struct worker *w, size_t size)
+{
+    lock(w);
+    void *p = buddy_malloc(w->pool, size);
+    unlock(w);
+    return p;
+}
+
+static void do_free(struct worker *w, void *p)
+{
+    lock(w);
+    buddy_free(w->pool, p);
+    unlock(w);
+}
+
+static size_t next_size(struct worker *w)
+{
+    return (size_t)(rand_r(&w->seed) % MAX_SIZE) + 16;
+}
+
+static void *run_private(void *arg)
+{
+    struct worker *w = arg;
+    void *slots[SLOTS] = {0};
+
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        int s = rand_r(&w->seed) % SLOTS;
+        if (slots[s]) {
+            do_free(w, slots[s]);
+            slots[s] = NULL;
+        } else {
+            slots[s] = do_malloc(w, next_size(w));
+        }
+    }
+    for (int s = 0; s < SLOTS; s++) {
+        if (slots[s]) do_free(w, slots[s]);
+    }
+    return NULL;
+}
+
+static void *run_prodcons(void *arg)
+{
+    struct worker *w = arg;
+    struct queue *q = w->queue;
+
+    // Each side makes OPS_PER_THREAD calls: the producer mallocs, the
+    // consumer frees
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        if (w->producer) {
+            void *p = do_malloc(w, next_size(w));
+            size_t head = q->head;
+            while (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+                sched_yield();
+            }
+            q->items[head % QUEUE_SIZE] = p;
+            __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+        } else {
+            size_t tail = q->tail;
+            while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) {
+                sched_yield();
+            }
+            do_free(w, q->items[tail % QUEUE_SIZE]);
+            __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+static void *run_larson(void *arg)
+{
+    struct worker *w = arg;
+
+    // Half the calls are mallocs, each replacing a block that may well
+    // have come from another thread
+    for (int i = 0; i < OPS_PER_THREAD / 2; i++) {
+        size_t s = (size_t)rand_r(&w->seed) % w->nshared;
+        void *p = do_malloc(w, next_size(w));
+        void *old = __atomic_exchange_n(&w->shared[s], p, __ATOMIC_ACQ_REL);
+        if (old) do_free(w, old);
+    }
+    return NULL;
+}
+
+struct mode
+{
+    const char *name;
+    unsigned int flags;
+    bool use_global_lock;
+};
+
+static void run(const char *workload, const struct mode *m, int nthreads)
+{
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << 28, m->flags);
+    global_waits = 0;
+
+    pthread_t threads[MAX_THREADS];
+    struct worker workers[MAX_THREADS];
+    static struct queue queues[MAX_THREADS / 2];
+    static void *shared[LARSON_SLOTS * MAX_THREADS];
+    memset(queues, 0, sizeof(queues));
+    memset(shared, 0, sizeof(shared));
+
+    void *(*fn)(void *) = run_private;
+    if (strcmp(workload, "prodcons") == 0) fn = run_prodcons;
+    if (strcmp(workload, "larson") == 0) fn = run_larson;
+
+    double start = now_ns();
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].pool = &pool;
+        workers[t].use_global_lock = m->use_global_lock;
+        workers[t].seed = (unsigned)t + 1;
+        workers[t].queue = &queues[t / 2];
+        workers[t].producer = (t % 2) == 0;
+        workers[t].shared = shared;
+        workers[t].nshared = (size_t)LARSON_SLOTS * (size_t)nthreads;
+        pthread_create(&threads[t], NULL, fn, &workers[t]);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    double ops = (double)OPS_PER_THREAD * nthreads;
+    struct buddy_stats st;
+    buddy_stats(&pool, &st);
+
+    // The three orders waited on most
+    size_t waits = 0;
+    size_t hot[3] = {0, 0, 0};
+    for (size_t k = 0; k < MAX_K; k++) {
+        waits += st.lock_waits[k];
+        for (int h = 0; h < 3; h++) {
+            if (st.lock_waits[k] > st.lock_waits[hot[h]]) {
+                memmove(&hot[h + 1], &hot[h], (size_t)(2 - h) * sizeof(hot[0]));
+                hot[h] = k;
+                break;
+            }
+        }
+    }
+    printf("%-9s %-14s threads=%d %12.0f ops/sec  waits/kop: global=%.2f orders=%.2f",
+           workload, m->name, nthreads, ops / (elapsed / 1e9),
+           1000.0 * (double)global_waits / ops, 1000.0 * (double)waits / ops);
+    for (int h = 0; h < 3 && st.lock_waits[hot[h]]; h++) {
+        printf(" k%zu:%zu", hot[h], st.lock_waits[hot[h]]);
+    }
+    printf(" inflight=%.2f\n", 1000.0 * (double)st.flight_waits / ops);
+
+    for (size_t s = 0; s < LARSON_SLOTS * MAX_THREADS; s++) {
+        if (shared[s]) buddy_free(&pool, shared[s]);
+    }
+    buddy_destroy(&pool);
+}
+
+int main(void)
+{
+    static const struct mode modes[] = {
+        { "global-mutex", 0, true },
+        { "order-locks", BUDDY_CONCURRENT, false },
+        { "tcache", BUDDY_CONCURRENT | BUDDY_THREAD_CACHE, false },
+        { "tcache+slab", BUDDY_CONCURRENT | BUDDY_THREAD_CACHE | BUDDY_SLAB, false },
+        { "lazy", BUDDY_CONCURRENT | BUDDY_LAZY, false },
+    };
+    static const char *const workloads[] = { "private", "prodcons", "larson" };
+
+    for (size_t w = 0; w < 3; w++) {
+        for (int n = 1; n <= MAX_THREADS; n *= 2) {
+            // A producer needs a consumer
+            if (strcmp(workloads[w], "prodcons") == 0 && n < 2) continue;
+            for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                run(workloads[w], &modes[m], n);
+            }
+        }
+    }
+    return 0;
+}
@@ -1,224 +1,3437 @@
+/* pthread_getattr_np, for the heap profiler's stack bounds */
+#define _GNU_SOURCE
 #include "lab.h"
 #include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <bits/mman-linux.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <stddef.h>
 
 // Debug macro - uncomment to enable debug prints
 // #define DEBUG_PRINT(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
 // #define DEBUG_PRINT(fmt, ...) /* disabled */
 
+/*
+ * Per-order locking. In BUDDY_CONCURRENT mode avail[k], and the AVAIL tag
+ * of every block on it, is guarded by locks[k]. A thread never holds more
+ * than one order lock at a time: splitting takes them from the high order
+ * down and coalescing from the low order up, each released before the
+ * next is taken, so there is no lock ordering to get wrong. Blocks that
+ * are off every list while being split or merged are marked reserved so
+ * no other thread will try to merge with them.
+ */
+static inline bool is_concurrent(struct buddy_pool *pool) {
+    return pool->flags & BUDDY_CONCURRENT;
+}
+
+static inline void order_lock(struct buddy_pool *pool, size_t k) {
+    if (is_concurrent(pool)) {
+#if BUDDY_STATS
+        // Count the acquisitions that had to wait, see buddy_stats
+        if (pthread_mutex_trylock(&pool->locks[k].mutex) == 0) {
+            return;
+        }
+        __atomic_fetch_add(&pool->stats.lock_waits[k], 1, __ATOMIC_RELAXED);
+#endif
+        pthread_mutex_lock(&pool->locks[k].mutex);
+    }
+}
+
+static inline void order_unlock(struct buddy_pool *pool, size_t k) {
+    if (is_concurrent(pool)) {
+        pthread_mutex_unlock(&pool->locks[k].mutex);
+    }
+}
+
+/*
+ * Out-of-band block metadata. pool->meta holds one byte per SMALLEST_K
+ * sized slot of the pool. The byte of the slot a block starts in packs
+ * the block state and kval (see BLOCK_META), every other byte is 0. All
+ * merge decisions are made from this table, so freeing a block never
+ * reads its buddy's memory unless the two are actually going to merge.
+ * Bytes belonging to other threads' blocks can be read while their owner
+ * rewrites them, so every access is a relaxed atomic.
+ */
+static inline size_t meta_index(struct buddy_pool *pool, void *block) {
+    return ((uintptr_t)block - (uintptr_t)pool->base) >> SMALLEST_K;
+}
+
+static inline uint8_t meta_get(struct buddy_pool *pool, void *block) {
+    return __atomic_load_n(&pool->meta[meta_index(pool, block)], __ATOMIC_RELAXED);
+}
+
+static inline void meta_set(struct buddy_pool *pool, void *block, uint8_t state, size_t k) {
+    __atomic_store_n(&pool->meta[meta_index(pool, block)], BLOCK_META(state, k), __ATOMIC_RELAXED);
+}
+
+static inline void meta_clear(struct buddy_pool *pool, void *block) {
+    __atomic_store_n(&pool->meta[meta_index(pool, block)], 0, __ATOMIC_RELAXED);
+}
+
+static inline size_t meta_kval(struct buddy_pool *pool, void *block) {
+    return meta_get(pool, block) & BLOCK_META_KVAL_MASK;
+}
+
+/*
+ * Purge bookkeeping. When purging is enabled every free block of order
+ * purge_k or more carries a struct avail_purge right behind its header,
+ * in the first page which is never purged. It records when the block went
+ * on its list and whether its body has been handed back to the OS.
+ */
+struct avail_purge
+{
+    uint64_t freed_ns;          /*When the block was put on its avail list*/
+    size_t purged;              /*Bytes of the block returned to the OS, 0 if none*/
+};
+
+static inline struct avail_purge *purge_info(struct avail *block) {
+    return (struct avail_purge *)(block + 1);
+}
+
+static inline bool is_purgeable(struct buddy_pool *pool, size_t k) {
+    size_t purge_k = __atomic_load_n(&pool->purge_k, __ATOMIC_RELAXED);
+    return purge_k && k >= purge_k;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static inline void purged_add(struct buddy_pool *pool, ssize_t bytes) {
+    __atomic_fetch_add(&pool->purged_bytes, (size_t)bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Statistics counters. Per-order free counts only change under their
+ * order lock, everything else can be bumped from any thread and is
+ * updated atomically in a concurrent pool. With BUDDY_STATS set to 0 the
+ * macros expand to nothing.
+ */
+#if BUDDY_STATS
+static inline void stat_add(struct buddy_pool *pool, size_t *counter, size_t delta) {
+    if (is_concurrent(pool)) {
+        __atomic_fetch_add(counter, delta, __ATOMIC_RELAXED);
+    } else {
+        *counter += delta;
+    }
+}
+
+static inline size_t stat_add_fetch(struct buddy_pool *pool, size_t *counter, size_t delta) {
+    return is_concurrent(pool) ? __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED)
+                               : (*counter += delta);
+}
+
+/*
+ * n blocks of order k leave the free lists for a caller. The peak is of
+ * the whole pool, so a growable pool and its arenas also keep a running
+ * total on the pool to measure it against.
+ */
+static inline void stat_reserve(struct buddy_pool *pool, size_t k, size_t n) {
+    struct buddy_counters *st = &pool->stats;
+    size_t bytes = n << k;
+    stat_add(pool, &st->alloc_blocks[k], n);
+    size_t used = stat_add_fetch(pool, &st->alloc_bytes, bytes);
+    if (pool->home || pool->arenas) {
+        pool = pool->home ? pool->home : pool;
+        st = &pool->stats;
+        used = stat_add_fetch(pool, &st->total_bytes, bytes);
+    }
+    size_t peak = __atomic_load_n(&st->peak_bytes, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&st->peak_bytes, &peak, used, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* A reserved block of order k goes back towards the free lists */
+static inline void stat_release(struct buddy_pool *pool, size_t k) {
+    stat_add(pool, &pool->stats.alloc_blocks[k], (size_t)-1);
+    stat_add(pool, &pool->stats.alloc_bytes, -(UINT64_C(1) << k));
+    if (pool->home || pool->arenas) {
+        pool = pool->home ? pool->home : pool;
+        stat_add(pool, &pool->stats.total_bytes, -(UINT64_C(1) << k));
+    }
+}
+
+#define STAT_ADD(pool, field, delta) stat_add((pool), &(pool)->stats.field, (size_t)(delta))
+#define STAT_FREE_BLOCKS(pool, k, delta) \
+    __atomic_store_n(&(pool)->stats.free_blocks[k], (pool)->stats.free_blocks[k] + (size_t)(delta), \
+                     __ATOMIC_RELAXED)
+/*
+ * Live requests. Freeing needs back the size the caller asked for, so the
+ * slack table behind meta holds, at the slot a live block starts in, the
+ * bytes of the block its request left unused. Slab objects are smaller
+ * than a slot and keep four bits per 8 bytes instead, the slack of the
+ * object starting there, which SLAB_MAX_SIZE keeps below 16. Blocks of
+ * 4 GiB and more with that much slack count as using all but 4 GiB.
+ */
+static inline uint32_t *slack_slot(struct buddy_pool *pool, void *addr) {
+    return &pool->slack[((uintptr_t)addr - (uintptr_t)pool->base) >> SMALLEST_K];
+}
+
+/* A block of order k goes to a caller that asked for size bytes */
+static inline void stat_live_block(struct buddy_pool *pool, void *block, size_t k, size_t size) {
+    size_t slack = (UINT64_C(1) << k) - size;
+    uint32_t kept = (slack > UINT32_MAX) ? UINT32_MAX : (uint32_t)slack;
+    *slack_slot(pool, block) = kept;
+    stat_add(pool, &pool->stats.live_reserved, UINT64_C(1) << k);
+    stat_add(pool, &pool->stats.live_requested, (UINT64_C(1) << k) - kept);
+}
+
+/* The caller is done with a block of order k */
+static inline void stat_dead_block(struct buddy_pool *pool, void *block, size_t k) {
+    uint32_t kept = *slack_slot(pool, block);
+    stat_add(pool, &pool->stats.live_reserved, -(UINT64_C(1) << k));
+    stat_add(pool, &pool->stats.live_requested, -((UINT64_C(1) << k) - kept));
+}
+
+static inline unsigned int slack_shift(struct buddy_pool *pool, void *obj) {
+    return (unsigned int)((((uintptr_t)obj - (uintptr_t)pool->base) >> 3) & 7) * 4;
+}
+
+/* A slab object of objsize bytes goes to a caller that asked for size */
+static inline void stat_live_obj(struct buddy_pool *pool, void *obj, size_t objsize, size_t size) {
+    uint32_t *slot = slack_slot(pool, obj);
+    unsigned int shift = slack_shift(pool, obj);
+    uint32_t bits = (uint32_t)(objsize - size) << shift;
+    // Objects sharing the slot may change under their own slab lock
+    if (is_concurrent(pool)) {
+        __atomic_fetch_and(slot, ~(UINT32_C(0xf) << shift), __ATOMIC_RELAXED);
+        __atomic_fetch_or(slot, bits, __ATOMIC_RELAXED);
+    } else {
+        *slot = (*slot & ~(UINT32_C(0xf) << shift)) | bits;
+    }
+    stat_add(pool, &pool->stats.live_reserved, objsize);
+    stat_add(pool, &pool->stats.live_requested, size);
+}
+
+/* The caller is done with a slab object of objsize bytes */
+static inline void stat_dead_obj(struct buddy_pool *pool, void *obj, size_t objsize) {
+    uint32_t slot = __atomic_load_n(slack_slot(pool, obj), __ATOMIC_RELAXED);
+    size_t slack = (slot >> slack_shift(pool, obj)) & 0xf;
+    stat_add(pool, &pool->stats.live_reserved, -objsize);
+    stat_add(pool, &pool->stats.live_requested, -(objsize - slack));
+}
+
+#define STAT_RESERVE(pool, k, n) stat_reserve((pool), (k), (n))
+#define STAT_RELEASE(pool, k) stat_release((pool), (k))
+#define STAT_LIVE_BLOCK(pool, block, k, size) stat_live_block((pool), (block), (k), (size))
+#define STAT_DEAD_BLOCK(pool, block, k) stat_dead_block((pool), (block), (k))
+#define STAT_LIVE_OBJ(pool, obj, objsize, size) stat_live_obj((pool), (obj), (objsize), (size))
+#define STAT_DEAD_OBJ(pool, obj, objsize) stat_dead_obj((pool), (obj), (objsize))
+#else
+#define STAT_ADD(pool, field, delta) ((void)0)
+#define STAT_FREE_BLOCKS(pool, k, delta) ((void)0)
+#define STAT_RESERVE(pool, k, n) ((void)0)
+#define STAT_RELEASE(pool, k) ((void)0)
+#define STAT_LIVE_BLOCK(pool, block, k, size) ((void)0)
+#define STAT_DEAD_BLOCK(pool, block, k) ((void)0)
+#define STAT_LIVE_OBJ(pool, obj, objsize, size) ((void)0)
+#define STAT_DEAD_OBJ(pool, obj, objsize) ((void)0)
+#endif
+
+/*
+ * Split and coalesce cascade depth of the call in progress on this
+ * thread, for the latency histograms. Counted whether or not the pool is
+ * being timed, a thread local add is cheaper than checking.
+ */
+#if BUDDY_LATENCY
+static __thread struct { size_t splits; size_t coalesces; } lat_depth;
+#define LAT_DEPTH(field, delta) (lat_depth.field += (size_t)(delta))
+#else
+#define LAT_DEPTH(field, delta) ((void)0)
+#endif
+
+/*
+ * Free list helpers. Every insert and remove goes through these so that
+ * pool->avail_bits always mirrors which avail[] lists are non-empty. The
+ * caller holds the order lock for k. Other orders flip their bits under
+ * their own locks, so the bitmap itself is updated atomically.
+ */
+static inline void avail_bits_set(struct buddy_pool *pool, size_t k) {
+    if (is_concurrent(pool)) {
+        __atomic_fetch_or(&pool->avail_bits, UINT64_C(1) << k, __ATOMIC_RELEASE);
+    } else {
+        pool->avail_bits |= UINT64_C(1) << k;
+    }
+}
+
+static inline void avail_bits_clear(struct buddy_pool *pool, size_t k) {
+    if (is_concurrent(pool)) {
+        __atomic_fetch_and(&pool->avail_bits, ~(UINT64_C(1) << k), __ATOMIC_RELEASE);
+    } else {
+        pool->avail_bits &= ~(UINT64_C(1) << k);
+    }
+}
+
+static inline void avail_push(struct buddy_pool *pool, struct avail *block, size_t k) {
+    meta_set(pool, block, BLOCK_AVAIL, k);
+    block->tag = BLOCK_AVAIL;
+    block->kval = k;
+    block->next = pool->avail[k].next;
+    block->prev = &pool->avail[k];
+    pool->avail[k].next->prev = block;
+    pool->avail[k].next = block;
+    avail_bits_set(pool, k);
+    STAT_FREE_BLOCKS(pool, k, 1);
+    if (is_purgeable(pool, k)) {
+        purge_info(block)->freed_ns = now_ns();
+        purge_info(block)->purged = 0;
+    }
+}
+
+/* Unlinks block of order k and hands it to the caller marked BLOCK_RESERVED */
+static inline void avail_remove(struct buddy_pool *pool, struct avail *block, size_t k) {
+    meta_set(pool, block, BLOCK_RESERVED, k);
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    block->tag = BLOCK_RESERVED;
+    if (pool->avail[k].next == &pool->avail[k]) {
+        avail_bits_clear(pool, k);
+    }
+    STAT_FREE_BLOCKS(pool, k, -1);
+
+    // Purged pages come back on first touch, so they stop counting as
+    // purged once the block leaves the list
+    if (is_purgeable(pool, k) && purge_info(block)->purged) {
+        purged_add(pool, -(ssize_t)purge_info(block)->purged);
+    }
+}
+
 size_t btok(size_t bytes) {
-    size_t k = SMALLEST_K;
-    size_t size = UINT64_C(1) << k;
+    // ceil(log2(bytes)) from the leading zero count of bytes - 1. Sizes of 0
+    // and 1 both map to a zero operand, and the | 1 keeps clz defined there.
+    uint64_t v = (uint64_t)bytes - (bytes != 0);
+    size_t k = 64 - (size_t)__builtin_clzll(v | 1);
+
+    // Clamp to the same SMALLEST_K..MAX_K range the old shift loop produced
+    k = (k < SMALLEST_K) ? SMALLEST_K : k;
+    k = (k > MAX_K) ? MAX_K : k;
+    return k;
+}
+
+void btok_batch(const size_t *bytes, size_t *kvals, size_t n) {
+    // Same arithmetic as btok with no data dependent branches so the
+    // compiler is free to vectorize the loop
+    for (size_t i = 0; i < n; i++) {
+        uint64_t v = (uint64_t)bytes[i] - (bytes[i] != 0);
+        size_t k = 64 - (size_t)__builtin_clzll(v | 1);
+        k = (k < SMALLEST_K) ? SMALLEST_K : k;
+        kvals[i] = (k > MAX_K) ? MAX_K : k;
+    }
+}
+
+struct avail *buddy_calc(struct buddy_pool *pool, struct avail *block) {
+    if (!pool || !pool->base || !block || block < (struct avail *)pool->base ||
+        (uintptr_t)block >= (uintptr_t)pool->base + pool->numbytes) {
+        return NULL;
+    }
+
+    // The kval comes from the side table, a slot no block starts in has none
+    size_t k = meta_kval(pool, block);
+    if (!k) {
+        return NULL;
+    }
+
+    // Calculate offset from base
+    uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
+    uintptr_t buddy_offset = offset ^ (UINT64_C(1) << k);
+    
+    // Calculate buddy address
+    struct avail *buddy = (struct avail *)((uintptr_t)pool->base + buddy_offset);
+    
+    // Validate buddy address
+    if ((uintptr_t)buddy < (uintptr_t)pool->base || 
+        (uintptr_t)buddy >= (uintptr_t)pool->base + pool->numbytes) {
+        return NULL;
+    }
     
-    // Find the smallest k where 2^k >= bytes
-    while (size < bytes && k < MAX_K) {
+    return buddy;
+}
+
+/*
+ * Takes a block of exactly order k off the free lists, splitting a larger
+ * one if needed. Returns NULL when nothing at or above k is free.
+ */
+static struct avail *block_alloc(struct buddy_pool *pool, size_t k) {
+    // Find smallest available block that fits: the lowest set bit at or
+    // above k in the order bitmap names the first non-empty list. Under
+    // concurrency another thread may empty that list before we lock it,
+    // in which case its bit is already clear and we look again.
+    struct avail *block = NULL;
+    size_t current_k;
+    do {
+        uint64_t bits = __atomic_load_n(&pool->avail_bits, __ATOMIC_ACQUIRE);
+        uint64_t candidates = (k < 64) ? bits & (~UINT64_C(0) << k) : 0;
+        if (!candidates) {
+            // Memory another thread is splitting or coalescing is on no
+            // list for a moment, wait for it rather than report ENOMEM
+            if (!is_concurrent(pool)) {
+                return NULL;
+            }
+            if (__atomic_load_n(&pool->in_flight, __ATOMIC_ACQUIRE)) {
+                STAT_ADD(pool, flight_waits, 1);
+                sched_yield();
+                continue;
+            }
+            if (__atomic_load_n(&pool->avail_bits, __ATOMIC_ACQUIRE) == bits) {
+                return NULL;
+            }
+            continue;
+        }
+        current_k = (size_t)__builtin_ctzll(candidates);
+
+        // Remove block from avail list, counting it as in flight while the
+        // halves are on their way back to the lists
+        order_lock(pool, current_k);
+        if (pool->avail[current_k].next != &pool->avail[current_k]) {
+            block = pool->avail[current_k].next;
+            if (current_k > k && is_concurrent(pool)) {
+                __atomic_fetch_add(&pool->in_flight, 1, __ATOMIC_ACQ_REL);
+            }
+            avail_remove(pool, block, current_k);
+        }
+        order_unlock(pool, current_k);
+    } while (!block);
+
+    // Split block if necessary
+    size_t start_k = current_k;
+    while (current_k > k) {
+        current_k--;
+        
+        // Create buddy block and add it to the avail list
+        struct avail *buddy = (struct avail *)((char *)block + (UINT64_C(1) << current_k));
+        order_lock(pool, current_k);
+        avail_push(pool, buddy, current_k);
+        order_unlock(pool, current_k);
+
+    }
+    if (current_k != start_k && is_concurrent(pool)) {
+        __atomic_fetch_sub(&pool->in_flight, 1, __ATOMIC_RELEASE);
+    }
+
+    // Record the final order of the block once, it stayed reserved while
+    // the split was in progress
+    meta_set(pool, block, BLOCK_RESERVED, k);
+    block->kval = k;
+    STAT_ADD(pool, splits, start_k - k);
+    LAT_DEPTH(splits, start_k - k);
+    STAT_RESERVE(pool, k, 1);
+    return block;
+}
+
+/*
+ * Takes up to n blocks of order k, carving them as siblings out of as few
+ * larger blocks as possible. Each round pops one block big enough for
+ * everything still wanted, or the largest one there is, hands out its
+ * leading order-k units and pushes the tail back as the fewest aligned
+ * blocks that cover it. Returns how many blocks were stored in out.
+ */
+static size_t block_alloc_batch(struct buddy_pool *pool, size_t k, size_t n, struct avail **out) {
+    size_t got = 0;
+    while (got < n) {
+        size_t want = n - got;
+        size_t want_k = k + (size_t)(want > 1 ? 64 - __builtin_clzll(want - 1) : 0);
+        uint64_t bits = __atomic_load_n(&pool->avail_bits, __ATOMIC_ACQUIRE);
+        uint64_t candidates = (k < 64) ? bits & (~UINT64_C(0) << k) : 0;
+        if (!candidates) {
+            // Single blocks know how to wait for splits in flight
+            struct avail *block = block_alloc(pool, k);
+            if (!block) {
+                break;
+            }
+            out[got++] = block;
+            continue;
+        }
+
+        // The smallest block that covers the rest, else the largest one
+        uint64_t big = (want_k < 64) ? candidates & (~UINT64_C(0) << want_k) : 0;
+        size_t j = big ? (size_t)__builtin_ctzll(big) : 63 - (size_t)__builtin_clzll(candidates);
+
+        struct avail *block = NULL;
+        order_lock(pool, j);
+        if (pool->avail[j].next != &pool->avail[j]) {
+            block = pool->avail[j].next;
+            if (is_concurrent(pool)) {
+                __atomic_fetch_add(&pool->in_flight, 1, __ATOMIC_ACQ_REL);
+            }
+            avail_remove(pool, block, j);
+        }
+        order_unlock(pool, j);
+        if (!block) {
+            continue;
+        }
+
+        // Hand out the leading units
+        size_t units = (size_t)1 << (j - k);
+        size_t take = (want < units) ? want : units;
+        for (size_t i = 0; i < take; i++) {
+            struct avail *unit = (struct avail *)((char *)block + (i << k));
+            meta_set(pool, unit, BLOCK_RESERVED, k);
+            unit->kval = k;
+            out[got++] = unit;
+        }
+
+        // Give the tail back, each piece as large as its alignment allows.
+        // Every block carved or pushed beyond the first took one split.
+        size_t pieces = take;
+        for (size_t i = take; i < units; i += i & -i) {
+            size_t piece_k = k + (size_t)__builtin_ctzll(i);
+            struct avail *piece = (struct avail *)((char *)block + (i << k));
+            order_lock(pool, piece_k);
+            avail_push(pool, piece, piece_k);
+            order_unlock(pool, piece_k);
+            pieces++;
+        }
+        STAT_ADD(pool, splits, pieces - 1);
+        LAT_DEPTH(splits, pieces - 1);
+        STAT_RESERVE(pool, k, take);
+        if (is_concurrent(pool)) {
+            __atomic_fetch_sub(&pool->in_flight, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return got;
+}
+
+/*
+ * Puts a reserved block of order k on the free lists, merging it with its
+ * buddy for as long as the buddy is free too, and returns the order it
+ * landed at. The block stays BLOCK_RESERVED until it lands on a list so no
+ * other thread tries to merge with it midway. A block that lands unmerged
+ * keeps purged bytes of its body handed back to the OS, aged from
+ * freed_ns; a merged block starts over as fully resident.
+ */
+static size_t block_return(struct buddy_pool *pool, struct avail *block, size_t k,
+                           size_t purged, uint64_t freed_ns) {
+    bool merging = false;
+    for (;;) {
+        order_lock(pool, k);
+
+        // Check if buddy is available for merging, from the side table only
+        struct avail *buddy = NULL;
+        if (k < pool->kval_m) {
+            uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
+            buddy = (struct avail *)((uintptr_t)pool->base + (offset ^ (UINT64_C(1) << k)));
+        }
+        if (!buddy || meta_get(pool, buddy) != BLOCK_META(BLOCK_AVAIL, k)) {
+            // Add block to appropriate avail list
+            avail_push(pool, block, k);
+            if (purged && !merging && is_purgeable(pool, k)) {
+                purge_info(block)->freed_ns = freed_ns;
+                purge_info(block)->purged = purged;
+                purged_add(pool, (ssize_t)purged);
+            }
+            order_unlock(pool, k);
+            if (merging && is_concurrent(pool)) {
+                __atomic_fetch_sub(&pool->in_flight, 1, __ATOMIC_RELEASE);
+            }
+            return k;
+        }
+
+        // Remove buddy from its avail list, the pair is in flight until the
+        // merged block lands on a list
+        if (!merging && is_concurrent(pool)) {
+            __atomic_fetch_add(&pool->in_flight, 1, __ATOMIC_ACQ_REL);
+        }
+        merging = true;
+        avail_remove(pool, buddy, k);
+        order_unlock(pool, k);
+
+        // Choose the lower address as the new block, the upper one is no
+        // longer the start of a block
+        if (buddy < block) {
+            meta_clear(pool, block);
+            block = buddy;
+        } else {
+            meta_clear(pool, buddy);
+        }
+
+        // Update block size
+        STAT_ADD(pool, coalesces, 1);
+        LAT_DEPTH(coalesces, 1);
         k++;
-        size = UINT64_C(1) << k;
     }
-    
-    return k;
 }
 
-struct avail *buddy_calc(struct buddy_pool *pool, struct avail *block) {
-    if (!pool || !block || block < (struct avail *)pool->base) {
-        return NULL;
+/* Hands the body of a block past its first page back to the OS */
+static bool purge_advise(struct buddy_pool *pool, struct avail *block, size_t page, size_t len) {
+    int advice = __atomic_load_n(&pool->purge_advice, __ATOMIC_RELAXED);
+    if (madvise((char *)block + page, len, advice) == 0) {
+        return true;
+    }
+    // MADV_FREE needs Linux 4.5, fall back for good on older kernels
+    if (advice == MADV_DONTNEED || madvise((char *)block + page, len, MADV_DONTNEED) != 0) {
+        return false;
+    }
+    __atomic_store_n(&pool->purge_advice, MADV_DONTNEED, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+ * Returns the body of every free block of order purge_k and up that has
+ * been free for at least the decay time (or any age when force is set) to
+ * the OS. The first page of each block holds its header and stays put.
+ * The blocks due are taken off their list under the order lock and chained
+ * through their next pointers, then advised and put back with the lock
+ * dropped, so a sweep run from buddy_free never holds up other threads
+ * for the length of the system calls.
+ */
+static void purge_sweep(struct buddy_pool *pool, bool force) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uint64_t now = now_ns();
+    size_t min_k = __atomic_load_n(&pool->purge_k, __ATOMIC_RELAXED);
+    uint64_t decay = __atomic_load_n(&pool->purge_decay_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->purge_last_ns, now, __ATOMIC_RELAXED);
+
+    for (size_t k = min_k; min_k && k <= pool->kval_m; k++) {
+        struct avail *due = NULL;
+        order_lock(pool, k);
+        for (struct avail *b = pool->avail[k].next, *next; b != &pool->avail[k]; b = next) {
+            next = b->next;
+            struct avail_purge *info = purge_info(b);
+            if (info->purged || (!force && now - info->freed_ns < decay)) {
+                continue;
+            }
+            // The blocks are on no list until they are put back
+            if (!due && is_concurrent(pool)) {
+                __atomic_fetch_add(&pool->in_flight, 1, __ATOMIC_ACQ_REL);
+            }
+            avail_remove(pool, b, k);
+            b->next = due;
+            due = b;
+        }
+        order_unlock(pool, k);
+        if (!due) {
+            continue;
+        }
+
+        size_t len = (UINT64_C(1) << k) - page;
+        while (due) {
+            struct avail *b = due;
+            due = b->next;
+            uint64_t freed_ns = purge_info(b)->freed_ns;
+            size_t purged = purge_advise(pool, b, page, len) ? len : 0;
+            if (purged) {
+                __atomic_fetch_add(&pool->purged_total, len, __ATOMIC_RELAXED);
+            }
+            block_return(pool, b, k, purged, freed_ns);
+        }
+        if (is_concurrent(pool)) {
+            __atomic_fetch_sub(&pool->in_flight, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* Runs a sweep once half the decay time has passed since the last one */
+static inline void purge_maybe(struct buddy_pool *pool) {
+    uint64_t last = __atomic_load_n(&pool->purge_last_ns, __ATOMIC_RELAXED);
+    if (now_ns() - last >= __atomic_load_n(&pool->purge_decay_ns, __ATOMIC_RELAXED) / 2) {
+        purge_sweep(pool, false);
+    }
+}
+
+/* Returns a block a caller was done with to the free lists */
+static void block_free(struct buddy_pool *pool, struct avail *block) {
+    size_t k = meta_kval(pool, block);
+    STAT_RELEASE(pool, k);
+    k = block_return(pool, block, k, 0, 0);
+    if (is_purgeable(pool, k)) {
+        purge_maybe(pool);
+    }
+}
+
+/*
+ * Splits the reserved block of order k down to order new_k, returning the
+ * upper half of each split to the free lists. The halves cannot coalesce
+ * with anything since their buddy is the block being kept. The block may
+ * be headerless and full of user data, so only the side table changes.
+ */
+static void block_shrink(struct buddy_pool *pool, struct avail *block, size_t k, size_t new_k) {
+    meta_set(pool, block, BLOCK_RESERVED, new_k);
+    STAT_RELEASE(pool, k);
+    STAT_RESERVE(pool, new_k, 1);
+    STAT_ADD(pool, splits, k - new_k);
+    LAT_DEPTH(splits, k - new_k);
+    while (k > new_k) {
+        k--;
+        struct avail *half = (struct avail *)((char *)block + (UINT64_C(1) << k));
+        order_lock(pool, k);
+        avail_push(pool, half, k);
+        order_unlock(pool, k);
+    }
+}
+
+/*
+ * Grows the reserved block of order k to order new_k without moving it by
+ * absorbing its upper buddy at each level. That needs the block to be the
+ * lower half at every level and each of those buddies to be free whole.
+ * The side table is checked up front so the common failure leaves the
+ * block alone. Under concurrency a buddy can still be taken between the
+ * check and the merge, then the block keeps what it absorbed so far and
+ * false is returned.
+ */
+static bool block_grow(struct buddy_pool *pool, struct avail *block, size_t k, size_t new_k) {
+    uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
+    if (new_k > pool->kval_m) {
+        return false;
+    }
+    for (size_t j = k; j < new_k; j++) {
+        struct avail *buddy = (struct avail *)((char *)block + (UINT64_C(1) << j));
+        if ((offset >> j) & 1 || meta_get(pool, buddy) != BLOCK_META(BLOCK_AVAIL, j)) {
+            return false;
+        }
+    }
+
+    for (; k < new_k; k++) {
+        struct avail *buddy = (struct avail *)((char *)block + (UINT64_C(1) << k));
+        order_lock(pool, k);
+        if (meta_get(pool, buddy) != BLOCK_META(BLOCK_AVAIL, k)) {
+            order_unlock(pool, k);
+            return false;
+        }
+        avail_remove(pool, buddy, k);
+        order_unlock(pool, k);
+        meta_clear(pool, buddy);
+        meta_set(pool, block, BLOCK_RESERVED, k + 1);
+        STAT_RELEASE(pool, k);
+        STAT_RESERVE(pool, k + 1, 1);
+        STAT_ADD(pool, coalesces, 1);
+        LAT_DEPTH(coalesces, 1);
+    }
+    return true;
+}
+
+/*
+ * Sorts batch free keys, order in the top byte and offset below it. Short
+ * batches use insertion sort, longer ones an LSD radix sort that skips
+ * every byte in which the keys do not differ.
+ */
+static void free_keys_sort(uint64_t *keys, uint64_t *tmp, size_t m) {
+    if (m <= 32) {
+        for (size_t i = 1; i < m; i++) {
+            uint64_t key = keys[i];
+            size_t j = i;
+            for (; j > 0 && keys[j - 1] > key; j--) {
+                keys[j] = keys[j - 1];
+            }
+            keys[j] = key;
+        }
+        return;
+    }
+
+    uint64_t diff = 0;
+    for (size_t i = 1; i < m; i++) {
+        diff |= keys[i] ^ keys[0];
+    }
+    for (unsigned int shift = 0; shift < 64; shift += 8) {
+        if (!((diff >> shift) & 0xff)) {
+            continue;
+        }
+        size_t count[257] = { 0 };
+        for (size_t i = 0; i < m; i++) {
+            count[((keys[i] >> shift) & 0xff) + 1]++;
+        }
+        for (size_t d = 1; d < 257; d++) {
+            count[d] += count[d - 1];
+        }
+        for (size_t i = 0; i < m; i++) {
+            tmp[count[(keys[i] >> shift) & 0xff]++] = keys[i];
+        }
+        memcpy(keys, tmp, m * sizeof(uint64_t));
+    }
+}
+
+#define FREE_KEY(k, offset) (((uint64_t)(k) << 56) | (uint64_t)(offset))
+#define FREE_KEY_ORDER(key) ((size_t)((key) >> 56))
+#define FREE_KEY_OFFSET(key) ((uintptr_t)((key) & ((UINT64_C(1) << 56) - 1)))
+#define FREE_BATCH_STACK 64
+#define FREE_BATCH_MIN 16
+
+/*
+ * Frees m reserved blocks given as FREE_KEY keys, with tmp room for 2 * m
+ * more. The blocks are sorted by order and address and coalesced one
+ * order at a time from the bottom: at each order the blocks freed there
+ * and the ones merged up from below form one sorted run, in which buddies
+ * sit next to each other. Pairs inside the run merge without touching a
+ * list, a block whose buddy is already free takes it off its list, and
+ * the rest are pushed, all under a single hold of that order's lock.
+ */
+static void block_free_batch(struct buddy_pool *pool, uint64_t *keys, size_t m, uint64_t *tmp) {
+    // A handful of blocks share too few parents to pay for the sort
+    if (m < FREE_BATCH_MIN) {
+        for (size_t i = 0; i < m; i++) {
+            block_free(pool, (struct avail *)((char *)pool->base + FREE_KEY_OFFSET(keys[i])));
+        }
+        return;
+    }
+    uint64_t *run = tmp;
+    uint64_t *carry = tmp + m;
+    free_keys_sort(keys, run, m);
+    for (size_t i = 0; i < m; i++) {
+        STAT_RELEASE(pool, FREE_KEY_ORDER(keys[i]));
+    }
+
+    // Buddies taken off their lists are in flight until the merged block
+    // lands on a list again
+    if (is_concurrent(pool)) {
+        __atomic_fetch_add(&pool->in_flight, 1, __ATOMIC_ACQ_REL);
+    }
+    size_t idx = 0;
+    size_t ncarry = 0;
+    for (size_t k = FREE_KEY_ORDER(keys[0]); k <= pool->kval_m && (idx < m || ncarry); k++) {
+        // Merge what came up from below with what was freed at this order
+        size_t len = 0;
+        size_t c = 0;
+        while (c < ncarry || (idx < m && FREE_KEY_ORDER(keys[idx]) == k)) {
+            if (idx < m && FREE_KEY_ORDER(keys[idx]) == k &&
+                (c == ncarry || FREE_KEY_OFFSET(keys[idx]) < carry[c])) {
+                run[len++] = FREE_KEY_OFFSET(keys[idx++]);
+            } else {
+                run[len++] = carry[c++];
+            }
+        }
+        if (!len) {
+            continue;
+        }
+
+        ncarry = 0;
+        uintptr_t size = UINT64_C(1) << k;
+        order_lock(pool, k);
+        for (size_t j = 0; j < len; j++) {
+            uintptr_t offset = run[j];
+            uintptr_t buddy = offset ^ size;
+            struct avail *block = (struct avail *)((char *)pool->base + offset);
+            struct avail *buddy_block = (struct avail *)((char *)pool->base + buddy);
+            if (k < pool->kval_m && j + 1 < len && run[j + 1] == buddy) {
+                // Both halves are in the batch
+                meta_clear(pool, buddy_block);
+                carry[ncarry++] = offset;
+                STAT_ADD(pool, coalesces, 1);
+                LAT_DEPTH(coalesces, 1);
+                j++;
+            } else if (k < pool->kval_m && meta_get(pool, buddy_block) == BLOCK_META(BLOCK_AVAIL, k)) {
+                // The other half is already free
+                avail_remove(pool, buddy_block, k);
+                meta_clear(pool, (offset < buddy) ? buddy_block : block);
+                carry[ncarry++] = offset & ~size;
+                STAT_ADD(pool, coalesces, 1);
+                LAT_DEPTH(coalesces, 1);
+            } else {
+                avail_push(pool, block, k);
+            }
+        }
+        order_unlock(pool, k);
+    }
+    if (is_concurrent(pool)) {
+        __atomic_fetch_sub(&pool->in_flight, 1, __ATOMIC_RELEASE);
+    }
+    if (pool->purge_k) {
+        purge_maybe(pool);
+    }
+}
+
+/*
+ * Per-thread caches. Each thread that touches a BUDDY_THREAD_CACHE pool
+ * gets a struct buddy_tcache holding a singly linked stack of reserved
+ * blocks for every order up to tcache_max_k, chained through the header
+ * next pointer. An empty stack is refilled with tcache_high / 2 blocks at
+ * once and a stack that grows past tcache_high is flushed back down to
+ * half of it, so a thread never hoards more than tcache_high blocks per
+ * order. The caches are registered on the pool so buddy_destroy can
+ * release them, and a pthread key destructor flushes them on thread exit.
+ */
+struct buddy_tcache
+{
+    struct buddy_pool *pool;
+    struct buddy_tcache *next;
+    struct buddy_tcache *prev;
+    unsigned int count[MAX_K];
+    struct avail *head[MAX_K];
+};
+
+static inline bool has_tcache(struct buddy_pool *pool) {
+    return pool->flags & BUDDY_THREAD_CACHE;
+}
+
+/* Hands all but keep of the cached blocks of order k back in one batch */
+static void tcache_flush_order(struct buddy_pool *pool, struct buddy_tcache *tc,
+                               size_t k, unsigned int keep) {
+    if (tc->count[k] <= keep) {
+        return;
+    }
+    size_t n = tc->count[k] - keep;
+    uint64_t stack_buf[3 * FREE_BATCH_STACK];
+    uint64_t *keys = (n > FREE_BATCH_STACK) ? malloc(3 * n * sizeof(uint64_t)) : stack_buf;
+    for (size_t i = 0; i < n; i++) {
+        struct avail *block = tc->head[k];
+        tc->head[k] = block->next;
+        if (keys) {
+            keys[i] = FREE_KEY(k, (uintptr_t)block - (uintptr_t)pool->base);
+        } else {
+            block_free(pool, block);
+        }
+    }
+    tc->count[k] = keep;
+    if (keys) {
+        block_free_batch(pool, keys, n, keys + n);
+    }
+    if (keys && keys != stack_buf) {
+        free(keys);
+    }
+}
+
+static void tcache_flush_all(struct buddy_pool *pool, struct buddy_tcache *tc) {
+    for (size_t k = SMALLEST_K; k <= pool->tcache_max_k; k++) {
+        tcache_flush_order(pool, tc, k, 0);
+    }
+}
+
+static void tcache_unregister(struct buddy_pool *pool, struct buddy_tcache *tc) {
+    pthread_mutex_lock(&pool->tcache_lock);
+    if (tc->prev) {
+        tc->prev->next = tc->next;
+    } else {
+        pool->tcaches = tc->next;
+    }
+    if (tc->next) {
+        tc->next->prev = tc->prev;
+    }
+    pthread_mutex_unlock(&pool->tcache_lock);
+}
+
+static void arena_release_if_free(struct buddy_pool *arena);
+
+/* pthread key destructor, runs when a thread that used the pool exits */
+static void tcache_thread_exit(void *arg) {
+    struct buddy_tcache *tc = arg;
+    struct buddy_pool *pool = tc->pool;
+    tcache_flush_all(pool, tc);
+    tcache_unregister(pool, tc);
+    free(tc);
+    // The flush may have emptied an arena, which goes like any other
+    arena_release_if_free(pool);
+}
+
+static struct buddy_tcache *tcache_get(struct buddy_pool *pool) {
+    struct buddy_tcache *tc = pthread_getspecific(pool->tcache_key);
+    if (tc) {
+        return tc;
+    }
+
+    tc = calloc(1, sizeof(*tc));
+    if (!tc) {
+        return NULL;
+    }
+    tc->pool = pool;
+    pthread_mutex_lock(&pool->tcache_lock);
+    tc->next = pool->tcaches;
+    if (tc->next) {
+        tc->next->prev = tc;
+    }
+    pool->tcaches = tc;
+    pthread_mutex_unlock(&pool->tcache_lock);
+    pthread_setspecific(pool->tcache_key, tc);
+    return tc;
+}
+
+static void tcache_refill(struct buddy_pool *pool, struct buddy_tcache *tc, size_t k) {
+    // Carve the whole batch out of one larger block where there is one
+    struct avail *blocks[64];
+    unsigned int batch = pool->tcache_high / 2;
+    if (batch < 1) batch = 1;
+    if (batch > 64) batch = 64;
+
+    size_t got = block_alloc_batch(pool, k, batch, blocks);
+    for (size_t i = got; i-- > 0;) {
+        blocks[i]->next = tc->head[k];
+        tc->head[k] = blocks[i];
+        tc->count[k]++;
+    }
+}
+
+/*
+ * Lazy coalescing. With BUDDY_LAZY a freed block is parked on the recently
+ * freed list of its order, still marked reserved so nothing merges with
+ * it, and the next request for that order takes it straight back without
+ * a split. Parked blocks are coalesced for real once an order collects
+ * more than lazy_high of them, the oldest half at a time, or all at once
+ * when a request finds nothing on the free lists. The lists are guarded
+ * by the order locks.
+ */
+static inline bool has_lazy(struct buddy_pool *pool) {
+    return pool->flags & BUDDY_LAZY;
+}
+
+/*
+ * Blocks taken off a lazy list are on no list at all until block_free has
+ * placed them, so they count as in flight for block_alloc to wait on.
+ */
+static inline void lazy_in_flight(struct buddy_pool *pool, int delta) {
+    if (is_concurrent(pool)) {
+        __atomic_fetch_add(&pool->in_flight, (size_t)delta,
+                           delta > 0 ? __ATOMIC_ACQ_REL : __ATOMIC_RELEASE);
+    }
+}
+
+static struct avail *lazy_pop(struct buddy_pool *pool, size_t k) {
+    if (!__atomic_load_n(&pool->lazy[k], __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    order_lock(pool, k);
+    struct avail *block = pool->lazy[k];
+    if (block) {
+        __atomic_store_n(&pool->lazy[k], block->next, __ATOMIC_RELAXED);
+        pool->lazy_count[k]--;
+    }
+    order_unlock(pool, k);
+    return block;
+}
+
+static void lazy_push(struct buddy_pool *pool, struct avail *block, size_t k) {
+    struct avail *spill = NULL;
+    order_lock(pool, k);
+    block->next = pool->lazy[k];
+    __atomic_store_n(&pool->lazy[k], block, __ATOMIC_RELAXED);
+    if (++pool->lazy_count[k] > pool->lazy_high) {
+        // Keep the newest half, they are the likeliest to be asked for
+        unsigned int keep = pool->lazy_high / 2;
+        struct avail **link = &pool->lazy[k];
+        for (unsigned int i = 0; i < keep; i++) {
+            link = &(*link)->next;
+        }
+        spill = *link;
+        __atomic_store_n(link, NULL, __ATOMIC_RELAXED);
+        pool->lazy_count[k] = keep;
+        lazy_in_flight(pool, 1);
+    }
+    order_unlock(pool, k);
+
+    if (spill) {
+        while (spill) {
+            struct avail *next = spill->next;
+            block_free(pool, spill);
+            spill = next;
+        }
+        lazy_in_flight(pool, -1);
+    }
+}
+
+/* Coalesces every parked block, returns whether there were any */
+static bool lazy_flush(struct buddy_pool *pool) {
+    bool flushed = false;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        if (!__atomic_load_n(&pool->lazy[k], __ATOMIC_RELAXED)) {
+            continue;
+        }
+        order_lock(pool, k);
+        struct avail *block = pool->lazy[k];
+        __atomic_store_n(&pool->lazy[k], NULL, __ATOMIC_RELAXED);
+        pool->lazy_count[k] = 0;
+        if (block) {
+            lazy_in_flight(pool, 1);
+        }
+        order_unlock(pool, k);
+
+        if (block) {
+            while (block) {
+                struct avail *next = block->next;
+                block_free(pool, block);
+                block = next;
+            }
+            lazy_in_flight(pool, -1);
+            flushed = true;
+        }
+    }
+    return flushed;
+}
+
+/*
+ * Slab front-end. With BUDDY_SLAB requests of up to SLAB_MAX_SIZE bytes
+ * are carved out of 2^SLAB_K pages taken from the pool. Each page starts
+ * with a struct buddy_slab holding a free bitmap for its objects and sits
+ * on its size class' partial list while it has free objects. The page is
+ * marked BLOCK_SLAB in the side table, which is how buddy_free recognizes
+ * slab objects, and goes back to the buddy lists once it is fully free.
+ */
+struct buddy_slab
+{
+    struct buddy_slab *next;    /*Next slab of this class with free objects*/
+    struct buddy_slab *prev;    /*Prev slab of this class with free objects*/
+    unsigned short int size;    /*Object size of this slab*/
+    unsigned short int nobjs;   /*Number of objects the page holds*/
+    unsigned short int nfree;   /*Number of those that are free*/
+    unsigned short int sclass;  /*Index into pool->slabs*/
+    uint64_t free_bits[SLAB_BITMAP_WORDS]; /*Bit i set when object i is free*/
+};
+
+/* Objects start at the first multiple of the largest class past the header */
+#define SLAB_DATA_OFFSET \
+    ((sizeof(struct buddy_slab) + SLAB_MAX_SIZE - 1) & ~(size_t)(SLAB_MAX_SIZE - 1))
+
+static inline bool has_slab(struct buddy_pool *pool) {
+    return pool->flags & BUDDY_SLAB;
+}
+
+static inline void slab_lock(struct buddy_pool *pool, size_t c) {
+    if (is_concurrent(pool)) {
+        pthread_mutex_lock(&pool->slab_locks[c].mutex);
+    }
+}
+
+static inline void slab_unlock(struct buddy_pool *pool, size_t c) {
+    if (is_concurrent(pool)) {
+        pthread_mutex_unlock(&pool->slab_locks[c].mutex);
+    }
+}
+
+/* Size class for size, classes are SLAB_MIN_SIZE, 2 * SLAB_MIN_SIZE, ... */
+static inline size_t slab_class(size_t size) {
+    if (size <= SLAB_MIN_SIZE) {
+        return 0;
+    }
+    size_t k = 64 - (size_t)__builtin_clzll((uint64_t)size - 1);
+    return k - (size_t)__builtin_ctz(SLAB_MIN_SIZE);
+}
+
+/* Returns the slab owning ptr, or NULL if ptr is not a slab object */
+static inline struct buddy_slab *slab_of(struct buddy_pool *pool, void *ptr) {
+    uintptr_t offset = (uintptr_t)ptr - (uintptr_t)pool->base;
+    void *page = (char *)pool->base + (offset & ~((UINT64_C(1) << SLAB_K) - 1));
+    if (BLOCK_META_STATE(meta_get(pool, page)) != BLOCK_SLAB) {
+        return NULL;
+    }
+    return (struct buddy_slab *)page;
+}
+
+static inline void slab_list_remove(struct buddy_pool *pool, struct buddy_slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        pool->slabs[slab->sclass] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static inline void slab_list_push(struct buddy_pool *pool, struct buddy_slab *slab) {
+    slab->prev = NULL;
+    slab->next = pool->slabs[slab->sclass];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    pool->slabs[slab->sclass] = slab;
+}
+
+static struct buddy_slab *slab_new(struct buddy_pool *pool, size_t c) {
+    struct avail *page = block_alloc(pool, SLAB_K);
+    if (!page) {
+        return NULL;
+    }
+    meta_set(pool, page, BLOCK_SLAB, SLAB_K);
+
+    struct buddy_slab *slab = (struct buddy_slab *)page;
+    slab->size = (unsigned short int)(SLAB_MIN_SIZE << c);
+    slab->nobjs = (unsigned short int)(((UINT64_C(1) << SLAB_K) - SLAB_DATA_OFFSET) / slab->size);
+    slab->nfree = slab->nobjs;
+    slab->sclass = (unsigned short int)c;
+    memset(slab->free_bits, 0, sizeof(slab->free_bits));
+    memset(slab->free_bits, 0xff, (slab->nobjs / 64) * sizeof(uint64_t));
+    if (slab->nobjs % 64) {
+        slab->free_bits[slab->nobjs / 64] = (UINT64_C(1) << (slab->nobjs % 64)) - 1;
+    }
+    return slab;
+}
+
+static void *slab_malloc(struct buddy_pool *pool, size_t size) {
+    size_t c = slab_class(size);
+    slab_lock(pool, c);
+    struct buddy_slab *slab = pool->slabs[c];
+    if (!slab) {
+        slab = slab_new(pool, c);
+        if (!slab) {
+            slab_unlock(pool, c);
+            return NULL;
+        }
+        slab_list_push(pool, slab);
+    }
+
+    // First free object from the bitmap, a slab on the list has at least one
+    size_t w = 0;
+    while (!slab->free_bits[w]) {
+        w++;
+    }
+    size_t i = w * 64 + (size_t)__builtin_ctzll(slab->free_bits[w]);
+    slab->free_bits[w] &= ~(UINT64_C(1) << (i % 64));
+    if (--slab->nfree == 0) {
+        slab_list_remove(pool, slab);
+    }
+    slab_unlock(pool, c);
+    return (char *)slab + SLAB_DATA_OFFSET + i * slab->size;
+}
+
+static void slab_free(struct buddy_pool *pool, struct buddy_slab *slab, void *ptr) {
+    STAT_DEAD_OBJ(pool, ptr, slab->size);
+    size_t c = slab->sclass;
+    size_t i = (size_t)((char *)ptr - ((char *)slab + SLAB_DATA_OFFSET)) / slab->size;
+    slab_lock(pool, c);
+    slab->free_bits[i / 64] |= UINT64_C(1) << (i % 64);
+    if (slab->nfree++ == 0) {
+        slab_list_push(pool, slab);
+    }
+    if (slab->nfree < slab->nobjs) {
+        slab_unlock(pool, c);
+        return;
+    }
+
+    // Fully free, hand the page back to the buddy lists
+    slab_list_remove(pool, slab);
+    slab_unlock(pool, c);
+    meta_set(pool, slab, BLOCK_RESERVED, SLAB_K);
+    block_free(pool, (struct avail *)slab);
+}
+
+/*
+ * Arenas of a BUDDY_GROWABLE pool. Each extra arena is a complete pool of
+ * order arena_k with its own lists and locks. The list is only appended
+ * to while other threads may read it, and a hash table maps an address
+ * shifted right by arena_k to the arenas covering that stretch. An arena
+ * is aligned to at least 2^BASE_ALIGN_MIN_K rather than to its size, so
+ * it may straddle two such stretches and is entered under both.
+ */
+#define ARENA_SLOTS (BUDDY_MAX_ARENAS * 8)
+
+struct arena_slot
+{
+    uintptr_t key;              /*Address >> arena_k*/
+    struct buddy_pool *arena;   /*Arena covering part of that stretch, NULL ends a probe*/
+};
+
+struct buddy_arenas
+{
+    pthread_mutex_t lock;       /*Serializes mapping and unmapping arenas*/
+    size_t count;               /*Arenas in list*/
+    struct buddy_pool *list[BUDDY_MAX_ARENAS];
+    struct arena_slot table[ARENA_SLOTS];
+};
+
+static inline bool in_pool(struct buddy_pool *pool, void *ptr) {
+    return (uintptr_t)ptr - (uintptr_t)pool->base < pool->numbytes;
+}
+
+static inline size_t arena_hash(uintptr_t key) {
+    return (size_t)((key * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (ARENA_SLOTS - 1);
+}
+
+static void arena_table_insert(struct buddy_arenas *ar, uintptr_t key, struct buddy_pool *arena) {
+    size_t i = arena_hash(key);
+    while (ar->table[i].arena) {
+        i = (i + 1) & (ARENA_SLOTS - 1);
+    }
+    // Readers check the arena first, so it goes in after its key
+    ar->table[i].key = key;
+    __atomic_store_n(&ar->table[i].arena, arena, __ATOMIC_RELEASE);
+}
+
+static void arena_table_add(struct buddy_pool *pool, struct buddy_pool *arena) {
+    uintptr_t first = (uintptr_t)arena->base >> pool->arena_k;
+    uintptr_t last = ((uintptr_t)arena->base + arena->numbytes - 1) >> pool->arena_k;
+    arena_table_insert(pool->arenas, first, arena);
+    if (last != first) {
+        arena_table_insert(pool->arenas, last, arena);
+    }
+}
+
+/* Finds the arena holding ptr, NULL when no arena does */
+static struct buddy_pool *arena_of(struct buddy_pool *pool, void *ptr) {
+    struct buddy_arenas *ar = pool->arenas;
+    uintptr_t key = (uintptr_t)ptr >> pool->arena_k;
+    for (size_t i = arena_hash(key);; i = (i + 1) & (ARENA_SLOTS - 1)) {
+        struct buddy_pool *arena = __atomic_load_n(&ar->table[i].arena, __ATOMIC_ACQUIRE);
+        if (!arena) {
+            return NULL;
+        }
+        if (ar->table[i].key == key && in_pool(arena, ptr)) {
+            return arena;
+        }
+    }
+}
+
+/* Finds the pool or arena that ptr was handed out from */
+static inline struct buddy_pool *owner_of(struct buddy_pool *pool, void *ptr) {
+    if (!pool->arenas || in_pool(pool, ptr)) {
+        return pool;
+    }
+    return arena_of(pool, ptr);
+}
+
+/* Maps one more arena, the caller holds the arenas lock */
+static struct buddy_pool *arena_new(struct buddy_pool *pool) {
+    struct buddy_arenas *ar = pool->arenas;
+    if (ar->count == BUDDY_MAX_ARENAS) {
+        return NULL;
+    }
+    // The per-order locks want the pool on a cache line boundary
+    struct buddy_pool *arena = aligned_alloc(_Alignof(struct buddy_pool), sizeof(struct buddy_pool));
+    if (!arena) {
+        return NULL;
+    }
+    struct buddy_init_opts opts = {
+        .size = UINT64_C(1) << pool->arena_k,
+        .flags = pool->flags & ~BUDDY_GROWABLE,
+        .map = pool->map,
+    };
+    buddy_init_ex(arena, &opts);
+    if (!arena->base) {
+        free(arena);
+        return NULL;
+    }
+    arena->tcache_max_k = pool->tcache_max_k;
+    arena->tcache_high = pool->tcache_high;
+    arena->lazy_high = pool->lazy_high;
+    arena->home = pool;
+    if (pool->purge_k) {
+        buddy_purge_config(arena, pool->purge_k, (unsigned int)(pool->purge_decay_ns / 1000000),
+                           pool->purge_advice);
+    }
+
+    arena_table_add(pool, arena);
+    ar->list[ar->count] = arena;
+    __atomic_store_n(&ar->count, ar->count + 1, __ATOMIC_RELEASE);
+    return arena;
+}
+
+static inline bool arena_is_free(struct buddy_pool *arena) {
+    return (arena->avail_bits >> arena->kval_m) & 1;
+}
+
+/* Takes an arena off the list and unmaps it */
+static void arena_unmap(struct buddy_pool *pool, struct buddy_pool *arena) {
+    struct buddy_arenas *ar = pool->arenas;
+    if (pool->publisher) {
+        // The publisher thread may be reading the arena's counters
+        return;
+    }
+    size_t idx = 0;
+    while (idx < ar->count && ar->list[idx] != arena) {
+        idx++;
+    }
+    if (idx == ar->count) {
+        return;
+    }
+    ar->list[idx] = ar->list[ar->count - 1];
+    __atomic_store_n(&ar->count, ar->count - 1, __ATOMIC_RELEASE);
+    memset(ar->table, 0, sizeof(ar->table));
+    for (size_t i = 0; i < ar->count; i++) {
+        arena_table_add(pool, ar->list[i]);
+    }
+    buddy_destroy(arena);
+    free(arena);
+}
+
+/*
+ * Unmaps a fully free arena, unless it is the only free one, which stays
+ * so a pool hovering at an arena boundary does not map and unmap on every
+ * call. Only pools without BUDDY_CONCURRENT get here, so nothing else can
+ * be looking at the arena.
+ */
+static void arena_release(struct buddy_pool *pool, struct buddy_pool *arena) {
+    struct buddy_arenas *ar = pool->arenas;
+    size_t idx = ar->count;
+    bool spare = false;
+    for (size_t i = 0; i < ar->count; i++) {
+        if (ar->list[i] == arena) {
+            idx = i;
+        } else if (arena_is_free(ar->list[i])) {
+            spare = true;
+        }
+    }
+    if (!spare || idx == ar->count) {
+        return;
+    }
+    arena_unmap(pool, arena);
+}
+
+/* Releases an arena that a free or a cache flush left with nothing in use */
+static void arena_release_if_free(struct buddy_pool *arena) {
+    struct buddy_pool *pool = arena->home;
+    if (pool && !is_concurrent(pool) && arena_is_free(arena)) {
+        arena_release(pool, arena);
+    }
+}
+
+static void arenas_destroy(struct buddy_pool *pool) {
+    struct buddy_arenas *ar = pool->arenas;
+    for (size_t i = 0; i < ar->count; i++) {
+        buddy_destroy(ar->list[i]);
+        free(ar->list[i]);
+    }
+    pthread_mutex_destroy(&ar->lock);
+    free(ar);
+    pool->arenas = NULL;
+}
+
+/*
+ * Maps size bytes at an address that is a multiple of align by reserving
+ * align bytes of slack and trimming what falls outside the aligned range.
+ * page is the granularity of the mapping, which is the huge page size for
+ * MAP_HUGETLB.
+ */
+static void *map_aligned(size_t size, size_t align, size_t page, int extra) {
+    size_t slack = (align > page) ? align - page : 0;
+    if (size + slack < size) {
+        return MAP_FAILED;
+    }
+
+    char *mem = mmap(NULL, size + slack, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | extra, -1, 0);
+    if (mem == MAP_FAILED || !slack) {
+        return mem;
+    }
+
+    char *start = (char *)(((uintptr_t)mem + align - 1) & ~(uintptr_t)(align - 1));
+    if (start > mem) {
+        munmap(mem, (size_t)(start - mem));
+    }
+    if (start + size < mem + size + slack) {
+        munmap(start + size, (size_t)((mem + size + slack) - (start + size)));
+    }
+    return start;
+}
+
+/*
+ * Maps a pool of 2^kval bytes aligned to its size, settling for
+ * BASE_ALIGN_MIN_K when the address space for the full alignment cannot be
+ * reserved.
+ */
+static void *map_pool(size_t kval, int extra) {
+    size_t size = UINT64_C(1) << kval;
+    size_t page = (extra & MAP_HUGETLB) ? UINT64_C(1) << BUDDY_HUGE_K
+                                        : (size_t)sysconf(_SC_PAGESIZE);
+    void *mem = map_aligned(size, size, page, extra);
+    if (mem == MAP_FAILED && kval > BASE_ALIGN_MIN_K) {
+        mem = map_aligned(size, UINT64_C(1) << BASE_ALIGN_MIN_K, page, extra);
+    }
+    return mem;
+}
+
+struct prefault_range
+{
+    char *start;
+    size_t len;
+};
+
+static void *prefault_run(void *arg) {
+    struct prefault_range *r = arg;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < r->len; off += page) {
+        // The pages are still zero, writing a zero is enough to fault one in
+        ((volatile char *)r->start)[off] = 0;
+    }
+    return NULL;
+}
+
+#if BUDDY_STATS
+/* Where the slack table starts in the side table mapping */
+static size_t slack_offset(size_t numbytes) {
+    size_t meta_size = numbytes >> SMALLEST_K;
+    return (meta_size + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+}
+#endif
+
+/* Bytes of the side table mapping: meta, then with stats the slack table */
+static size_t side_table_size(size_t numbytes) {
+#if BUDDY_STATS
+    return slack_offset(numbytes) + (numbytes >> SMALLEST_K) * sizeof(uint32_t);
+#else
+    return numbytes >> SMALLEST_K;
+#endif
+}
+
+/*
+ * Faults in every page of [start, start + len) by touching one byte per
+ * page, split over nthreads threads. Any slice a thread could not be
+ * started for is touched by the caller.
+ */
+static void prefault(char *start, size_t len, unsigned int nthreads) {
+    if (nthreads > 64) nthreads = 64;
+    if (nthreads < 1) nthreads = 1;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t slice = ((len / nthreads) + page - 1) & ~(page - 1);
+
+    pthread_t threads[64];
+    struct prefault_range ranges[64];
+    bool started[64];
+    for (unsigned int t = 0; t < nthreads; t++) {
+        size_t off = slice * t;
+        ranges[t].start = start + off;
+        ranges[t].len = (off >= len) ? 0 : (len - off < slice ? len - off : slice);
+        started[t] = (t > 0 && pthread_create(&threads[t], NULL, prefault_run, &ranges[t]) == 0);
+    }
+    prefault_run(&ranges[0]);
+    for (unsigned int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            prefault_run(&ranges[t]);
+        }
+    }
+}
+
+/*
+ * Faults in [start, start + len) for write. MADV_POPULATE_WRITE does it in
+ * one call on Linux 5.14 and later, older kernels get touched page by page.
+ */
+static void populate(char *start, size_t len) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, len, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    prefault(start, len, 1);
+}
+
+void buddy_init(struct buddy_pool *pool, size_t size) {
+    buddy_init_flags(pool, size, 0);
+}
+
+void buddy_init_flags(struct buddy_pool *pool, size_t size, unsigned int flags) {
+    struct buddy_init_opts opts = { .size = size, .flags = flags };
+    buddy_init_ex(pool, &opts);
+}
+
+void buddy_init_ex(struct buddy_pool *pool, struct buddy_init_opts *opts) {
+    if (!pool || !opts) return;
+    size_t size = opts->size;
+    unsigned int flags = opts->flags;
+    unsigned int map = 0;
+    opts->applied = 0;
+
+    // If size is 0, use DEFAULT_K
+    if (size == 0) {
+        size = UINT64_C(1) << DEFAULT_K;
+    }
+
+    // Calculate required kval, avail[] only has room up to MAX_K - 1
+    pool->base = NULL;
+    size_t kval = btok(size);
+    if (kval > MAX_K - 1) {
+        errno = ENOMEM;
+        return;
+    }
+    size_t actual_size = UINT64_C(1) << kval;
+
+    // Map memory aligned to the pool size so every block of order k lands
+    // on a 2^k boundary in virtual memory. Huge pages come from a pool the
+    // administrator has to reserve, so a normal mapping is the fallback.
+    int reserve = (opts->map & BUDDY_MAP_NORESERVE) ? MAP_NORESERVE : 0;
+    void *mem = MAP_FAILED;
+    if ((opts->map & BUDDY_MAP_HUGETLB) && kval >= BUDDY_HUGE_K) {
+        mem = map_pool(kval, MAP_HUGETLB | reserve);
+        if (mem != MAP_FAILED) {
+            map |= BUDDY_MAP_HUGETLB;
+        }
+    }
+    if (mem == MAP_FAILED) {
+        mem = map_pool(kval, reserve);
+    }
+    if (mem != MAP_FAILED) {
+        map |= opts->map & BUDDY_MAP_NORESERVE;
+    }
+    if (mem == MAP_FAILED) {
+        errno = ENOMEM;
+        return;
+    }
+    if ((opts->map & (BUDDY_MAP_THP | BUDDY_MAP_HUGETLB)) && !(map & BUDDY_MAP_HUGETLB) &&
+        madvise(mem, actual_size, MADV_HUGEPAGE) == 0) {
+        map |= BUDDY_MAP_THP;
+    }
+
+    // Map the side table, one byte per SMALLEST_K slot and with stats
+    // the slack table behind it. Pages that are never written are never
+    // backed, so small allocations touch little.
+    size_t meta_size = side_table_size(actual_size);
+    uint8_t *meta = mmap(NULL, meta_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (meta == MAP_FAILED) {
+        munmap(mem, actual_size);
+        errno = ENOMEM;
+        return;
+    }
+
+    // Take the page faults now rather than on first use, locking first
+    // since mlock faults the pages in itself
+    if ((opts->map & BUDDY_MAP_LOCKED) && mlock(mem, actual_size) == 0) {
+        map |= BUDDY_MAP_LOCKED;
+    }
+    if (opts->map & BUDDY_MAP_PREFAULT) {
+        unsigned int nthreads = opts->prefault_threads;
+        if (!nthreads) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            nthreads = (cpus > 0) ? (unsigned int)cpus : 1;
+        }
+        prefault(mem, actual_size, nthreads);
+        prefault((char *)meta, meta_size, nthreads);
+        map |= BUDDY_MAP_PREFAULT;
+    } else if (opts->map & BUDDY_MAP_POPULATE) {
+        populate(mem, actual_size);
+        populate((char *)meta, meta_size);
+        map |= BUDDY_MAP_POPULATE;
+    }
+
+    // Initialize pool
+    pool->kval_m = kval;
+    pool->numbytes = actual_size;
+    pool->base = mem;
+    pool->meta = meta;
+#if BUDDY_STATS
+    pool->slack = (uint32_t *)(meta + slack_offset(actual_size));
+#endif
+    pool->flags = flags;
+    pool->map = map;
+    opts->applied = map;
+
+    // A growable pool keeps the table of its extra arenas on the heap
+    pool->arenas = NULL;
+    pool->home = NULL;
+    pool->arena_k = opts->arena_size ? btok(opts->arena_size) : kval;
+    if (pool->arena_k > MAX_K - 1) {
+        pool->arena_k = kval;
+    }
+    if (flags & BUDDY_GROWABLE) {
+        pool->arenas = calloc(1, sizeof(struct buddy_arenas));
+        if (!pool->arenas) {
+            munmap(mem, actual_size);
+            munmap(meta, meta_size);
+            pool->base = NULL;
+            errno = ENOMEM;
+            return;
+        }
+        pthread_mutex_init(&pool->arenas->lock, NULL);
+    }
+
+    // Initialize avail array
+    for (size_t i = 0; i <= MAX_K - 1; i++) {
+        pool->avail[i].tag = BLOCK_UNUSED;
+        pool->avail[i].kval = i;
+        pool->avail[i].next = &pool->avail[i];
+        pool->avail[i].prev = &pool->avail[i];
+        if (is_concurrent(pool)) {
+            pthread_mutex_init(&pool->locks[i].mutex, NULL);
+        }
+    }
+
+    // Thread caches are created lazily by each thread on first use
+    pool->tcaches = NULL;
+    pool->tcache_max_k = TCACHE_DEFAULT_MAX_K;
+    pool->tcache_high = TCACHE_DEFAULT_HIGH;
+
+    // Nothing is parked until the first lazy free
+    for (size_t i = 0; i < MAX_K; i++) {
+        pool->lazy[i] = NULL;
+        pool->lazy_count[i] = 0;
+    }
+    pool->lazy_high = LAZY_DEFAULT_HIGH;
+    if (has_tcache(pool)) {
+        pthread_mutex_init(&pool->tcache_lock, NULL);
+        pthread_key_create(&pool->tcache_key, tcache_thread_exit);
+    }
+
+    // Slabs are carved from the pool on the first small request
+    for (size_t c = 0; c < SLAB_CLASSES; c++) {
+        pool->slabs[c] = NULL;
+        if (has_slab(pool) && is_concurrent(pool)) {
+            pthread_mutex_init(&pool->slab_locks[c].mutex, NULL);
+        }
+    }
+
+    // Purging is off until buddy_purge_config turns it on
+    pool->purge_k = 0;
+    pool->purge_decay_ns = 0;
+    pool->purge_advice = MADV_FREE;
+    pool->purge_last_ns = 0;
+    pool->purged_bytes = 0;
+    pool->purged_total = 0;
+
+    // Nothing is recorded or published until asked for
+    pool->trace = NULL;
+    pool->latency = NULL;
+    pool->publisher = NULL;
+    pool->heap_prof = NULL;
+#if BUDDY_STATS
+    memset(&pool->stats, 0, sizeof(pool->stats));
+#endif
+
+    // Link base block into avail array
+    pool->avail_bits = 0;
+    pool->in_flight = 0;
+    avail_push(pool, (struct avail *)mem, kval);
+}
+
+void buddy_destroy(struct buddy_pool *pool) {
+    if (!pool || !pool->base) return;
+    buddy_trace_stop(pool);
+    buddy_latency_stop(pool);
+    buddy_publish_stop(pool);
+    buddy_heap_profile_stop(pool);
+    if (pool->arenas) {
+        arenas_destroy(pool);
+    }
+    munmap(pool->base, pool->numbytes);
+    munmap(pool->meta, side_table_size(pool->numbytes));
+    pool->base = NULL;
+    pool->meta = NULL;
+    if (has_tcache(pool)) {
+        // The cached blocks went away with the mapping, only the cache
+        // structs of threads that are still alive are left to release
+        pthread_key_delete(pool->tcache_key);
+        while (pool->tcaches) {
+            struct buddy_tcache *tc = pool->tcaches;
+            pool->tcaches = tc->next;
+            free(tc);
+        }
+        pthread_mutex_destroy(&pool->tcache_lock);
+    }
+    if (is_concurrent(pool)) {
+        for (size_t i = 0; i <= MAX_K - 1; i++) {
+            pthread_mutex_destroy(&pool->locks[i].mutex);
+        }
+        for (size_t c = 0; has_slab(pool) && c < SLAB_CLASSES; c++) {
+            pthread_mutex_destroy(&pool->slab_locks[c].mutex);
+        }
+    }
+}
+
+void buddy_purge_config(struct buddy_pool *pool, size_t min_k, unsigned int decay_ms, int advice) {
+    if (!pool || !pool->base) return;
+
+    // The first page of a block is never purged, so smaller blocks have
+    // nothing to give back
+    size_t page_k = (size_t)__builtin_ctzll((uint64_t)sysconf(_SC_PAGESIZE));
+    if (min_k && min_k <= page_k) {
+        min_k = page_k + 1;
+    }
+
+    // Blocks purged under the old settings stop counting as purged, their
+    // pages come back on first touch anyway, and the blocks that are free
+    // under the new ones are stamped so they age from now
+    uint64_t now = now_ns();
+    size_t old_k = pool->purge_k;
+    size_t lo = (old_k && (!min_k || old_k < min_k)) ? old_k : min_k;
+    for (size_t k = lo; lo && k <= pool->kval_m; k++) {
+        order_lock(pool, k);
+        for (struct avail *b = pool->avail[k].next; b != &pool->avail[k]; b = b->next) {
+            struct avail_purge *info = purge_info(b);
+            if (old_k && k >= old_k && info->purged) {
+                purged_add(pool, -(ssize_t)info->purged);
+            }
+            if (min_k && k >= min_k) {
+                info->freed_ns = now;
+                info->purged = 0;
+            }
+        }
+        order_unlock(pool, k);
+    }
+    __atomic_store_n(&pool->purge_decay_ns, (uint64_t)decay_ms * UINT64_C(1000000), __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->purge_advice, (advice == MADV_DONTNEED) ? MADV_DONTNEED : MADV_FREE,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->purge_last_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->purge_k, min_k, __ATOMIC_RELEASE);
+
+    size_t count = pool->arenas ? __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE) : 0;
+    for (size_t i = 0; i < count; i++) {
+        buddy_purge_config(pool->arenas->list[i], min_k, decay_ms, advice);
+    }
+}
+
+void buddy_purge(struct buddy_pool *pool, bool force) {
+    if (!pool || !pool->base || !pool->purge_k) return;
+    purge_sweep(pool, force);
+    size_t count = pool->arenas ? __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE) : 0;
+    for (size_t i = 0; i < count; i++) {
+        purge_sweep(pool->arenas->list[i], force);
+    }
+}
+
+void buddy_purge_stats(struct buddy_pool *pool, struct buddy_purge_stats *out) {
+    if (!pool || !out) return;
+    size_t numbytes = pool->numbytes;
+    out->purged_bytes = __atomic_load_n(&pool->purged_bytes, __ATOMIC_RELAXED);
+    out->purged_total = __atomic_load_n(&pool->purged_total, __ATOMIC_RELAXED);
+    size_t count = pool->arenas ? __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE) : 0;
+    for (size_t i = 0; i < count; i++) {
+        struct buddy_pool *arena = pool->arenas->list[i];
+        numbytes += arena->numbytes;
+        out->purged_bytes += __atomic_load_n(&arena->purged_bytes, __ATOMIC_RELAXED);
+        out->purged_total += __atomic_load_n(&arena->purged_total, __ATOMIC_RELAXED);
+    }
+    out->resident_bytes = numbytes - out->purged_bytes;
+}
+
+void buddy_lazy_config(struct buddy_pool *pool, unsigned int high_water) {
+    if (!pool) return;
+    pool->lazy_high = high_water;
+
+    size_t count = pool->arenas ? __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE) : 0;
+    for (size_t i = 0; i < count; i++) {
+        buddy_lazy_config(pool->arenas->list[i], high_water);
+    }
+}
+
+void buddy_coalesce(struct buddy_pool *pool) {
+    if (!pool || !pool->base || !has_lazy(pool)) return;
+    lazy_flush(pool);
+    if (!pool->arenas) return;
+
+    size_t count = __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE);
+    for (size_t i = count; i-- > 0;) {
+        struct buddy_pool *arena = pool->arenas->list[i];
+        lazy_flush(arena);
+        if (!is_concurrent(pool) && arena_is_free(arena)) {
+            arena_release(pool, arena);
+        }
+    }
+}
+
+/* Adds the counters of one pool or arena to out */
+static void stats_collect(struct buddy_pool *pool, struct buddy_stats *out) {
+    uint64_t bits = __atomic_load_n(&pool->avail_bits, __ATOMIC_ACQUIRE);
+    if (bits) {
+        size_t top = 63 - (size_t)__builtin_clzll(bits);
+        out->largest_free_k = (top > out->largest_free_k) ? top : out->largest_free_k;
+    }
+#if BUDDY_STATS
+    struct buddy_counters *st = &pool->stats;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        size_t nfree = __atomic_load_n(&st->free_blocks[k], __ATOMIC_RELAXED);
+        size_t nalloc = __atomic_load_n(&st->alloc_blocks[k], __ATOMIC_RELAXED);
+        out->free_blocks[k] += nfree;
+        out->alloc_blocks[k] += nalloc;
+        out->free_bytes += nfree << k;
+        out->lock_waits[k] += __atomic_load_n(&st->lock_waits[k], __ATOMIC_RELAXED);
+    }
+    out->alloc_bytes += __atomic_load_n(&st->alloc_bytes, __ATOMIC_RELAXED);
+    out->requested_bytes += __atomic_load_n(&st->requested_bytes, __ATOMIC_RELAXED);
+    out->reserved_bytes += __atomic_load_n(&st->reserved_bytes, __ATOMIC_RELAXED);
+    out->live_requested_bytes += __atomic_load_n(&st->live_requested, __ATOMIC_RELAXED);
+    out->live_reserved_bytes += __atomic_load_n(&st->live_reserved, __ATOMIC_RELAXED);
+    out->splits += __atomic_load_n(&st->splits, __ATOMIC_RELAXED);
+    out->coalesces += __atomic_load_n(&st->coalesces, __ATOMIC_RELAXED);
+    out->failures += __atomic_load_n(&st->failures, __ATOMIC_RELAXED);
+    out->mallocs += __atomic_load_n(&st->mallocs, __ATOMIC_RELAXED);
+    out->frees += __atomic_load_n(&st->frees, __ATOMIC_RELAXED);
+    out->flight_waits += __atomic_load_n(&st->flight_waits, __ATOMIC_RELAXED);
+#endif
+}
+
+void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out) {
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    if (!pool || !pool->base) return;
+
+    stats_collect(pool, out);
+    size_t count = pool->arenas ? __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE) : 0;
+    for (size_t i = 0; i < count; i++) {
+        stats_collect(pool->arenas->list[i], out);
+    }
+#if BUDDY_STATS
+    out->peak_bytes = __atomic_load_n(&pool->stats.peak_bytes, __ATOMIC_RELAXED);
+#endif
+    if (out->free_bytes) {
+        size_t largest = UINT64_C(1) << out->largest_free_k;
+        out->fragmentation = 1.0 - (double)largest / (double)out->free_bytes;
+    }
+}
+
+size_t buddy_arena_count(struct buddy_pool *pool) {
+    if (!pool || !pool->arenas) return 0;
+    return __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE);
+}
+
+void buddy_thread_cache_config(struct buddy_pool *pool, size_t max_k, unsigned int high_water) {
+    if (!pool) return;
+    pool->tcache_max_k = (max_k > MAX_K - 1) ? MAX_K - 1 : max_k;
+    pool->tcache_high = high_water;
+
+    size_t count = pool->arenas ? __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE) : 0;
+    for (size_t i = 0; i < count; i++) {
+        buddy_thread_cache_config(pool->arenas->list[i], max_k, high_water);
+    }
+}
+
+void buddy_thread_cache_flush(struct buddy_pool *pool) {
+    if (!pool || !pool->base || !has_tcache(pool)) return;
+    struct buddy_tcache *tc = pthread_getspecific(pool->tcache_key);
+    if (tc) {
+        tcache_flush_all(pool, tc);
+    }
+    if (!pool->arenas) return;
+
+    // Flushed blocks can leave an arena with nothing in use. Going from the
+    // newest down keeps the walk valid while empty arenas are released.
+    size_t count = __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE);
+    for (size_t i = count; i-- > 0;) {
+        struct buddy_pool *arena = pool->arenas->list[i];
+        buddy_thread_cache_flush(arena);
+        arena_release_if_free(arena);
+    }
+}
+
+/*
+ * Pointer to block mapping. Pools hand out either block + 1, leaving room
+ * for the in-band header, or with BUDDY_HEADERLESS the block address
+ * itself. Blocks start on a 2^SMALLEST_K boundary and a headered pointer
+ * never does, so the pointer alone says which kind it is and the order
+ * always comes from the side table.
+ */
+static inline size_t header_size(struct buddy_pool *pool) {
+    return (pool->flags & BUDDY_HEADERLESS) ? 0 : sizeof(struct avail);
+}
+
+static inline struct avail *ptr_to_block(struct buddy_pool *pool, void *ptr) {
+    uintptr_t offset = (uintptr_t)ptr - (uintptr_t)pool->base;
+    if ((offset & ((UINT64_C(1) << SMALLEST_K) - 1)) == 0) {
+        return (struct avail *)ptr;
+    }
+    return ((struct avail *)ptr) - 1;
+}
+
+/*
+ * Gets a block of order k, from the calling thread's cache when it has
+ * one for that order and from the free lists otherwise.
+ */
+static struct avail *alloc_order(struct buddy_pool *pool, size_t k) {
+    // Small orders are served from the calling thread's cache first
+    struct avail *block = NULL;
+    if (has_tcache(pool) && k <= pool->tcache_max_k) {
+        struct buddy_tcache *tc = tcache_get(pool);
+        if (tc) {
+            if (!tc->head[k]) {
+                tcache_refill(pool, tc, k);
+            }
+            block = tc->head[k];
+            if (block) {
+                tc->head[k] = block->next;
+                tc->count[k]--;
+            }
+        }
+    }
+
+    // Lazy pools hand back a parked block of the same order first, and
+    // coalesce what is parked only when the lists come up empty
+    if (!block && has_lazy(pool)) {
+        block = lazy_pop(pool, k);
+        if (block) {
+            return block;
+        }
+    }
+
+    if (!block) {
+        block = block_alloc(pool, k);
+    }
+    if (!block && has_lazy(pool) && lazy_flush(pool)) {
+        block = block_alloc(pool, k);
+    }
+    return block;
+}
+
+static void *pool_malloc(struct buddy_pool *pool, size_t size) {
+    if (!pool || !pool->base || size == 0 || size > pool->numbytes) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Tiny objects come out of a slab when there is one to be had
+    if (has_slab(pool) && size <= SLAB_MAX_SIZE) {
+        void *obj = slab_malloc(pool, size);
+        if (obj) {
+            STAT_ADD(pool, requested_bytes, size);
+            STAT_ADD(pool, reserved_bytes, SLAB_MIN_SIZE << slab_class(size));
+            STAT_LIVE_OBJ(pool, obj, SLAB_MIN_SIZE << slab_class(size), size);
+            STAT_ADD(pool, mallocs, 1);
+            return obj;
+        }
+    }
+
+    // Calculate required block size including header
+    size_t total_size = size + header_size(pool);
+    size_t k = btok(total_size);
+    
+    // DEBUG_PRINT("Malloc request: %zu bytes (k=%zu)\n", size, k);
+
+    struct avail *block = alloc_order(pool, k);
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    // DEBUG_PRINT("Allocated block at %p (k=%u)\n", block, block->kval);
+    STAT_ADD(pool, requested_bytes, size);
+    STAT_ADD(pool, reserved_bytes, UINT64_C(1) << k);
+    STAT_LIVE_BLOCK(pool, block, k, size);
+    STAT_ADD(pool, mallocs, 1);
+    
+    return (void *)((char *)block + header_size(pool));
+}
+
+static void *pool_aligned_alloc(struct buddy_pool *pool, size_t alignment, size_t size) {
+    if (!pool || !pool->base || size == 0 || size > pool->numbytes) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // The in-band header already leaves block + 1 on an 8 byte boundary
+    if (alignment <= sizeof(void *)) {
+        return pool_malloc(pool, size);
+    }
+
+    // A block of order k sits on a 2^k boundary relative to base, so it is
+    // only that aligned in memory as far as base itself is
+    uintptr_t base_align = (uintptr_t)pool->base & -(uintptr_t)pool->base;
+    if (alignment > base_align || alignment > pool->numbytes) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Hand out the bare block, it is naturally aligned to its own size and
+    // buddy_free recovers its order from the side table
+    size_t k = btok(size);
+    size_t align_k = (size_t)__builtin_ctzll(alignment);
+    k = (k > align_k) ? k : align_k;
+    struct avail *block = alloc_order(pool, k);
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    STAT_ADD(pool, requested_bytes, size);
+    STAT_ADD(pool, reserved_bytes, UINT64_C(1) << k);
+    STAT_LIVE_BLOCK(pool, block, k, size);
+    STAT_ADD(pool, mallocs, 1);
+    return block;
+}
+
+/*
+ * Serves a request the pool itself could not from the arenas, mapping a
+ * new one when none of them has room. alignment is 0 for buddy_malloc.
+ */
+static void *arena_alloc(struct buddy_pool *pool, size_t alignment, size_t size) {
+    struct buddy_arenas *ar = pool->arenas;
+
+    // A request an empty arena could not serve must not map one, it would
+    // fail there as well and only use up the arena slots
+    size_t arena_bytes = UINT64_C(1) << pool->arena_k;
+    if (alignment > sizeof(void *)) {
+        if (alignment & (alignment - 1)) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (size > arena_bytes || alignment > arena_bytes) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else if (size > arena_bytes - header_size(pool)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (;;) {
+        size_t count = __atomic_load_n(&ar->count, __ATOMIC_ACQUIRE);
+        for (size_t i = count; i-- > 0;) {
+            // Newest first, older arenas are the likelier to be full
+            struct buddy_pool *arena = ar->list[i];
+            void *ptr = alignment ? pool_aligned_alloc(arena, alignment, size)
+                                  : pool_malloc(arena, size);
+            if (ptr) {
+                return ptr;
+            }
+        }
+
+        // Map a new arena unless another thread already did while we looked
+        pthread_mutex_lock(&ar->lock);
+        struct buddy_pool *fresh = NULL;
+        bool grown = (ar->count != count) || (fresh = arena_new(pool));
+        pthread_mutex_unlock(&ar->lock);
+        if (!grown) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        // The new arena fits the request unless other threads have already
+        // taken its memory, then everything is looked at again
+        if (fresh) {
+            void *ptr = alignment ? pool_aligned_alloc(fresh, alignment, size)
+                                  : pool_malloc(fresh, size);
+            if (ptr) {
+                return ptr;
+            }
+            if (errno != ENOMEM || arena_is_free(fresh)) {
+                // Nothing can be in an arena of a single threaded pool that
+                // failed its first request, so it goes again right away
+                if (!is_concurrent(pool)) {
+                    int err = errno;
+                    arena_unmap(pool, fresh);
+                    errno = err;
+                }
+                return NULL;
+            }
+        }
+    }
+}
+
+/*
+ * Trace recorder. Calls claim a slot of a power-of-two ring by bumping
+ * head, fill it in and publish it by storing its position + 1 in the slot
+ * sequence. The writer thread copies published slots out from tail,
+ * advances tail so they can be reused and writes the copies to the file.
+ * A caller that finds the ring full drops its record instead of waiting.
+ */
+struct buddy_trace_slot
+{
+    uint64_t seq;
+    struct buddy_trace_record rec;
+};
+
+struct buddy_trace
+{
+    struct buddy_trace_slot *ring;
+    size_t mask;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t dropped;
+    int fd;
+    bool stop;
+    pthread_t writer;
+    pthread_mutex_t lock;       /*Guards stop, for the writer's timed wait*/
+    pthread_cond_t wake;
+};
+
+#define TRACE_FLUSH_NS 1000000
+#define TRACE_WRITE_BATCH 1024
+
+static inline bool is_tracing(struct buddy_pool *pool) {
+    return pool && __builtin_expect(pool->trace != NULL, 0);
+}
+
+/* Order of the block behind a live pointer, 0 for slab objects */
+static size_t trace_order(struct buddy_pool *root, void *ptr) {
+    struct buddy_pool *pool = ptr ? owner_of(root, ptr) : NULL;
+    if (!pool || (has_slab(pool) && slab_of(pool, ptr))) {
+        return 0;
+    }
+    return meta_kval(pool, ptr_to_block(pool, ptr));
+}
+
+/*
+ * Claims the next ring slot and stamps it with the time, which fixes the
+ * record's place in the file. Returns the position, or UINT64_MAX when
+ * the ring is full and the record is dropped.
+ */
+static uint64_t trace_claim(struct buddy_trace *tr) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t pos = __atomic_load_n(&tr->head, __ATOMIC_RELAXED);
+    do {
+        if (pos - __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE) > tr->mask) {
+            __atomic_fetch_add(&tr->dropped, 1, __ATOMIC_RELAXED);
+            return UINT64_MAX;
+        }
+    } while (!__atomic_compare_exchange_n(&tr->head, &pos, pos + 1, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    tr->ring[pos & tr->mask].rec.ts_ns = (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+    return pos;
+}
+
+/* Fills in the slot claimed at pos and hands it to the writer */
+static void trace_publish(struct buddy_pool *pool, uint64_t pos, uint8_t op, void *ptr,
+                          uint64_t old_id, size_t size) {
+    struct buddy_trace *tr = pool->trace;
+    if (pos == UINT64_MAX) {
+        return;
+    }
+    struct buddy_trace_slot *slot = &tr->ring[pos & tr->mask];
+    slot->rec.id = (uintptr_t)ptr;
+    slot->rec.old_id = old_id;
+    slot->rec.size = size;
+    slot->rec.op = op;
+    slot->rec.order = (uint8_t)trace_order(pool, ptr);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_op(struct buddy_pool *pool, uint8_t op, void *ptr, uint64_t old_id, size_t size) {
+    trace_publish(pool, trace_claim(pool->trace), op, ptr, old_id, size);
+}
+
+/* Writes out up to TRACE_WRITE_BATCH published records, returns how many */
+static size_t trace_drain(struct buddy_trace *tr) {
+    struct buddy_trace_record buf[TRACE_WRITE_BATCH];
+    size_t n = 0;
+    uint64_t pos = tr->tail;
+    while (n < TRACE_WRITE_BATCH) {
+        struct buddy_trace_slot *slot = &tr->ring[pos & tr->mask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        buf[n++] = slot->rec;
+        pos++;
+    }
+    __atomic_store_n(&tr->tail, pos, __ATOMIC_RELEASE);
+
+    const char *p = (const char *)buf;
+    size_t left = n * sizeof(buf[0]);
+    while (left) {
+        ssize_t w = write(tr->fd, p, left);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        p += w;
+        left -= (size_t)w;
+    }
+    return n;
+}
+
+static void *trace_writer(void *arg) {
+    struct buddy_trace *tr = arg;
+    pthread_mutex_lock(&tr->lock);
+    for (;;) {
+        bool stop = tr->stop;
+        pthread_mutex_unlock(&tr->lock);
+        // Drain in bursts and nap in between, reading slots right behind the
+        // callers would pull their cache lines away while they write them
+        while (trace_drain(tr) == TRACE_WRITE_BATCH) {
+        }
+        if (stop) {
+            return NULL;
+        }
+
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_nsec += TRACE_FLUSH_NS;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&tr->lock);
+        if (!tr->stop) {
+            pthread_cond_timedwait(&tr->wake, &tr->lock, &until);
+        }
+    }
+}
+
+int buddy_trace_start(struct buddy_pool *pool, const char *path, size_t ring_records) {
+    if (!pool || !pool->base || !path) return EINVAL;
+    if (pool->trace) return EBUSY;
+    if (!ring_records) {
+        ring_records = BUDDY_TRACE_DEFAULT_RECORDS;
+    }
+    size_t cap = UINT64_C(1) << btok(ring_records);
+
+    struct buddy_trace *tr = calloc(1, sizeof(*tr));
+    if (!tr) return ENOMEM;
+    tr->ring = calloc(cap, sizeof(struct buddy_trace_slot));
+    if (!tr->ring) {
+        free(tr);
+        return ENOMEM;
+    }
+    tr->mask = cap - 1;
+    tr->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tr->fd < 0) {
+        int err = errno;
+        free(tr->ring);
+        free(tr);
+        return err;
+    }
+
+    struct buddy_trace_header hdr = {
+        .magic = BUDDY_TRACE_MAGIC,
+        .version = BUDDY_TRACE_VERSION,
+        .record_size = sizeof(struct buddy_trace_record),
+        .pool_bytes = pool->numbytes,
+        .flags = pool->flags,
+    };
+    if (write(tr->fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+        int err = errno ? errno : EIO;
+        close(tr->fd);
+        free(tr->ring);
+        free(tr);
+        return err;
+    }
+
+    pthread_mutex_init(&tr->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&tr->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    int err = pthread_create(&tr->writer, NULL, trace_writer, tr);
+    if (err) {
+        pthread_cond_destroy(&tr->wake);
+        pthread_mutex_destroy(&tr->lock);
+        close(tr->fd);
+        free(tr->ring);
+        free(tr);
+        return err;
+    }
+    pool->trace = tr;
+    return 0;
+}
+
+uint64_t buddy_trace_stop(struct buddy_pool *pool) {
+    if (!pool || !pool->trace) return 0;
+    struct buddy_trace *tr = pool->trace;
+    pool->trace = NULL;
+
+    pthread_mutex_lock(&tr->lock);
+    tr->stop = true;
+    pthread_cond_signal(&tr->wake);
+    pthread_mutex_unlock(&tr->lock);
+    pthread_join(tr->writer, NULL);
+
+    uint64_t dropped = tr->dropped;
+    pthread_cond_destroy(&tr->wake);
+    pthread_mutex_destroy(&tr->lock);
+    close(tr->fd);
+    free(tr->ring);
+    free(tr);
+    return dropped;
+}
+
+/*
+ * Latency histograms. Each thread that calls into a timed pool gets a
+ * struct buddy_lat_thread, registered on the pool's struct buddy_lat and
+ * found again through a pthread key, with one struct buddy_latency per
+ * operation and order allocated the first time that pair is timed. Only
+ * the owning thread writes its histograms, one relaxed store per counter,
+ * so readers can add them up at any time without stopping anyone. When a
+ * thread exits its histograms stay registered, marked idle, and the next
+ * thread to register takes them over instead of allocating its own.
+ */
+#if BUDDY_LATENCY
+struct buddy_lat_thread
+{
+    struct buddy_lat_thread *next;
+    bool idle;                  /*Owner exited, free to take over*/
+    struct buddy_latency *hist[BUDDY_LAT_OPS][MAX_K];
+};
+
+struct buddy_lat
+{
+    uint64_t id;                /*Unique across starts, tags the thread local cache*/
+    pthread_key_t key;
+    pthread_mutex_t lock;       /*Guards threads*/
+    struct buddy_lat_thread *threads;
+};
+
+/* Last timed pool this thread used, saves the pthread_getspecific */
+static __thread struct buddy_lat_thread *lat_mine;
+static __thread uint64_t lat_mine_id;
+static uint64_t lat_next_id = 1;
+
+/* Fine grained unlike now_ns, for counters without one of their own */
+static inline uint64_t lat_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t lat_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return lat_clock_ns();
+#endif
+}
+
+static inline size_t lat_bucket(uint64_t v) {
+    if (v < (1u << BUDDY_LAT_SUB_BITS)) {
+        return (size_t)v;
+    }
+    unsigned int e = 63 - (unsigned int)__builtin_clzll(v);
+    return ((size_t)(e - BUDDY_LAT_SUB_BITS + 1) << BUDDY_LAT_SUB_BITS) +
+           (size_t)((v >> (e - BUDDY_LAT_SUB_BITS)) & ((1u << BUDDY_LAT_SUB_BITS) - 1));
+}
+
+/* Lower bound of bucket b */
+static uint64_t lat_bucket_value(size_t b) {
+    if (b < (1u << BUDDY_LAT_SUB_BITS)) {
+        return b;
+    }
+    unsigned int e = (unsigned int)(b >> BUDDY_LAT_SUB_BITS) + BUDDY_LAT_SUB_BITS - 1;
+    return (UINT64_C(1) << e) |
+           ((uint64_t)(b & ((1u << BUDDY_LAT_SUB_BITS) - 1)) << (e - BUDDY_LAT_SUB_BITS));
+}
+
+/* pthread key destructor, hands the thread's histograms to the next one */
+static void lat_thread_exit(void *arg) {
+    struct buddy_lat_thread *t = arg;
+    __atomic_store_n(&t->idle, true, __ATOMIC_RELEASE);
+}
+
+static struct buddy_lat_thread *lat_register(struct buddy_lat *lat) {
+    pthread_mutex_lock(&lat->lock);
+    struct buddy_lat_thread *t = lat->threads;
+    while (t && !__atomic_load_n(&t->idle, __ATOMIC_ACQUIRE)) {
+        t = t->next;
+    }
+    if (t) {
+        t->idle = false;
+    } else if ((t = calloc(1, sizeof(*t)))) {
+        t->next = lat->threads;
+        lat->threads = t;
+    }
+    pthread_mutex_unlock(&lat->lock);
+    if (t) {
+        pthread_setspecific(lat->key, t);
+    }
+    return t;
+}
+
+static inline bool is_timed(struct buddy_pool *pool) {
+    return pool && __builtin_expect(pool->latency != NULL, 0);
+}
+
+/* Starts timing a call, 0 when the pool is not timed */
+static inline uint64_t lat_start(struct buddy_pool *pool) {
+    if (!is_timed(pool)) {
+        return 0;
+    }
+    lat_depth.splits = 0;
+    lat_depth.coalesces = 0;
+    uint64_t t = lat_cycles();
+    return t ? t : 1;
+}
+
+/* Cycles since t0, read before anything else the call does afterwards */
+static inline uint64_t lat_stop(uint64_t t0) {
+    return lat_cycles() - t0;
+}
+
+static inline void lat_bump(uint64_t *counter, uint64_t delta) {
+    __atomic_store_n(counter, *counter + delta, __ATOMIC_RELAXED);
+}
+
+/* Files a call that took cycles, an operation on a block of order k */
+static void lat_record(struct buddy_pool *pool, int op, size_t k, uint64_t cycles) {
+    struct buddy_lat *lat = pool->latency;
+    struct buddy_lat_thread *t = lat_mine;
+    if (lat_mine_id != lat->id) {
+        t = pthread_getspecific(lat->key);
+        if (!t && !(t = lat_register(lat))) {
+            return;
+        }
+        lat_mine = t;
+        lat_mine_id = lat->id;
+    }
+
+    struct buddy_latency *h = t->hist[op][k];
+    if (!h) {
+        if (!(h = calloc(1, sizeof(*h)))) {
+            return;
+        }
+        __atomic_store_n(&t->hist[op][k], h, __ATOMIC_RELEASE);
+    }
+    lat_bump(&h->count, 1);
+    lat_bump(&h->cycles, cycles);
+    if (cycles > h->max) {
+        __atomic_store_n(&h->max, cycles, __ATOMIC_RELAXED);
+    }
+    lat_bump(&h->buckets[lat_bucket(cycles)], 1);
+    lat_bump(&h->split_depth[lat_depth.splits < MAX_K ? lat_depth.splits : MAX_K - 1], 1);
+    lat_bump(&h->coalesce_depth[lat_depth.coalesces < MAX_K ? lat_depth.coalesces : MAX_K - 1], 1);
+}
+
+static void lat_merge(struct buddy_latency *out, const struct buddy_latency *h) {
+    out->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    out->cycles += __atomic_load_n(&h->cycles, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (max > out->max) {
+        out->max = max;
+    }
+    for (size_t b = 0; b < BUDDY_LAT_BUCKETS; b++) {
+        out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    }
+    for (size_t d = 0; d < MAX_K; d++) {
+        out->split_depth[d] += __atomic_load_n(&h->split_depth[d], __ATOMIC_RELAXED);
+        out->coalesce_depth[d] += __atomic_load_n(&h->coalesce_depth[d], __ATOMIC_RELAXED);
+    }
+}
+#else
+static inline bool is_timed(struct buddy_pool *pool) {
+    (void)pool;
+    return false;
+}
+
+static inline uint64_t lat_start(struct buddy_pool *pool) {
+    (void)pool;
+    return 0;
+}
+
+static inline uint64_t lat_stop(uint64_t t0) {
+    (void)t0;
+    return 0;
+}
+
+static inline void lat_record(struct buddy_pool *pool, int op, size_t k, uint64_t cycles) {
+    (void)pool;
+    (void)op;
+    (void)k;
+    (void)cycles;
+}
+#endif
+
+int buddy_latency_start(struct buddy_pool *pool) {
+    if (!pool || !pool->base) return EINVAL;
+#if BUDDY_LATENCY
+    if (pool->latency) return EBUSY;
+    struct buddy_lat *lat = calloc(1, sizeof(*lat));
+    if (!lat) return ENOMEM;
+    int err = pthread_key_create(&lat->key, lat_thread_exit);
+    if (err) {
+        free(lat);
+        return err;
+    }
+    pthread_mutex_init(&lat->lock, NULL);
+    lat->id = __atomic_fetch_add(&lat_next_id, 1, __ATOMIC_RELAXED);
+
+    // Calibrate now rather than in the middle of the first read
+    buddy_latency_cycles_per_ns();
+    pool->latency = lat;
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+void buddy_latency_stop(struct buddy_pool *pool) {
+#if BUDDY_LATENCY
+    if (!pool || !pool->latency) return;
+    struct buddy_lat *lat = pool->latency;
+    pool->latency = NULL;
+
+    pthread_key_delete(lat->key);
+    while (lat->threads) {
+        struct buddy_lat_thread *t = lat->threads;
+        lat->threads = t->next;
+        for (size_t op = 0; op < BUDDY_LAT_OPS; op++) {
+            for (size_t k = 0; k < MAX_K; k++) {
+                free(t->hist[op][k]);
+            }
+        }
+        free(t);
+    }
+    pthread_mutex_destroy(&lat->lock);
+    free(lat);
+#else
+    (void)pool;
+#endif
+}
+
+void buddy_latency_read(struct buddy_pool *pool, int op, size_t k, struct buddy_latency *out) {
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+#if BUDDY_LATENCY
+    if (!pool || !pool->latency || op < 0 || op >= BUDDY_LAT_OPS || k > BUDDY_LAT_ALL_ORDERS) {
+        return;
+    }
+    struct buddy_lat *lat = pool->latency;
+    size_t lo = (k == BUDDY_LAT_ALL_ORDERS) ? 0 : k;
+    size_t hi = (k == BUDDY_LAT_ALL_ORDERS) ? MAX_K - 1 : k;
+    pthread_mutex_lock(&lat->lock);
+    for (struct buddy_lat_thread *t = lat->threads; t; t = t->next) {
+        for (size_t j = lo; j <= hi; j++) {
+            struct buddy_latency *h = __atomic_load_n(&t->hist[op][j], __ATOMIC_ACQUIRE);
+            if (h) {
+                lat_merge(out, h);
+            }
+        }
+    }
+    pthread_mutex_unlock(&lat->lock);
+#else
+    (void)pool;
+    (void)op;
+    (void)k;
+#endif
+}
+
+uint64_t buddy_latency_percentile(const struct buddy_latency *h, double p) {
+#if BUDDY_LATENCY
+    if (!h || !h->count) return 0;
+    uint64_t want = (uint64_t)(p * (double)h->count);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < BUDDY_LAT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > want) {
+            return lat_bucket_value(b);
+        }
     }
+    return h->max;
+#else
+    (void)h;
+    (void)p;
+    return 0;
+#endif
+}
 
-    // Calculate offset from base
-    uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
-    uintptr_t buddy_offset = offset ^ (UINT64_C(1) << block->kval);
-    
-    // Calculate buddy address
-    struct avail *buddy = (struct avail *)((uintptr_t)pool->base + buddy_offset);
-    
-    // Validate buddy address
-    if ((uintptr_t)buddy < (uintptr_t)pool->base || 
-        (uintptr_t)buddy >= (uintptr_t)pool->base + pool->numbytes) {
+#if BUDDY_LATENCY && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+static double lat_rate = 1.0;
+static pthread_once_t lat_rate_once = PTHREAD_ONCE_INIT;
+
+/* Counts cycles across 10ms of CLOCK_MONOTONIC */
+static void lat_calibrate(void) {
+    uint64_t ns0 = lat_clock_ns();
+    uint64_t c0 = lat_cycles();
+    struct timespec nap = { 0, 10000000 };
+    while (nanosleep(&nap, &nap) != 0 && errno == EINTR) {
+    }
+    uint64_t c1 = lat_cycles();
+    uint64_t ns1 = lat_clock_ns();
+    if (ns1 > ns0 && c1 > c0) {
+        lat_rate = (double)(c1 - c0) / (double)(ns1 - ns0);
+    }
+}
+
+double buddy_latency_cycles_per_ns(void) {
+    pthread_once(&lat_rate_once, lat_calibrate);
+    return lat_rate;
+}
+#else
+double buddy_latency_cycles_per_ns(void) {
+    return 1.0;
+}
+#endif
+
+/*
+ * Shared memory stats page. A publisher thread wakes every interval,
+ * gathers buddy_stats and buddy_purge_stats like any other reader of the
+ * counters would and writes the snapshot into the page under a sequence
+ * count. Building the snapshot takes no lock, so the allocation paths
+ * never notice it; readers in other processes retry the copy instead of
+ * waiting on anything.
+ */
+struct buddy_publisher
+{
+    struct buddy_pool *pool;
+    struct buddy_shm_page *page;
+    char name[64];
+    uint64_t interval_ns;
+    size_t last_mallocs;
+    size_t last_frees;
+    uint64_t last_ns;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;       /*Guards stop, for the publisher's timed wait*/
+    pthread_cond_t wake;
+};
+
+static void publish(struct buddy_publisher *pb) {
+    struct buddy_pool *pool = pb->pool;
+    struct buddy_shm_page snap;
+    memset(&snap, 0, sizeof(snap));
+    buddy_stats(pool, &snap.stats);
+    buddy_purge_stats(pool, &snap.purge);
+    snap.arenas = buddy_arena_count(pool);
+    snap.purge_k = __atomic_load_n(&pool->purge_k, __ATOMIC_ACQUIRE);
+    snap.purge_decay_ns = __atomic_load_n(&pool->purge_decay_ns, __ATOMIC_RELAXED);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+    if (pb->last_ns && now > pb->last_ns) {
+        double secs = (double)(now - pb->last_ns) / 1e9;
+        snap.malloc_rate = (double)(snap.stats.mallocs - pb->last_mallocs) / secs;
+        snap.free_rate = (double)(snap.stats.frees - pb->last_frees) / secs;
+    }
+    pb->last_mallocs = snap.stats.mallocs;
+    pb->last_frees = snap.stats.frees;
+    pb->last_ns = now;
+
+    // The header fields never change, only the snapshot after them is
+    // rewritten while seq is odd
+    struct buddy_shm_page *page = pb->page;
+    uint64_t seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    page->updated_ns = now;
+    page->updates++;
+    size_t from = offsetof(struct buddy_shm_page, arenas);
+    memcpy((char *)page + from, (char *)&snap + from, sizeof(snap) - from);
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *publisher_thread(void *arg) {
+    struct buddy_publisher *pb = arg;
+    pthread_mutex_lock(&pb->lock);
+    while (!pb->stop) {
+        pthread_mutex_unlock(&pb->lock);
+        publish(pb);
+
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        uint64_t ns = (uint64_t)until.tv_nsec + pb->interval_ns;
+        until.tv_sec += (time_t)(ns / 1000000000);
+        until.tv_nsec = (long)(ns % 1000000000);
+        pthread_mutex_lock(&pb->lock);
+        if (!pb->stop) {
+            pthread_cond_timedwait(&pb->wake, &pb->lock, &until);
+        }
+    }
+    pthread_mutex_unlock(&pb->lock);
+    return NULL;
+}
+
+int buddy_publish_start(struct buddy_pool *pool, const char *name, unsigned int interval_ms) {
+    if (!pool || !pool->base) return EINVAL;
+    if (pool->publisher) return EBUSY;
+    if (!interval_ms) {
+        interval_ms = BUDDY_SHM_DEFAULT_MS;
+    }
+
+    struct buddy_publisher *pb = calloc(1, sizeof(*pb));
+    if (!pb) return ENOMEM;
+    if (name) {
+        if (name[0] != '/' || strlen(name) >= sizeof(pb->name)) {
+            free(pb);
+            return EINVAL;
+        }
+        strcpy(pb->name, name);
+    } else {
+        snprintf(pb->name, sizeof(pb->name), BUDDY_SHM_PREFIX "%ld", (long)getpid());
+    }
+
+    int fd = shm_open(pb->name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int err = errno;
+        free(pb);
+        return err;
+    }
+    if (ftruncate(fd, sizeof(struct buddy_shm_page)) != 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(pb->name);
+        free(pb);
+        return err;
+    }
+    pb->page = mmap(NULL, sizeof(struct buddy_shm_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pb->page == MAP_FAILED) {
+        int err = errno;
+        shm_unlink(pb->name);
+        free(pb);
+        return err;
+    }
+
+    pb->pool = pool;
+    pb->interval_ns = (uint64_t)interval_ms * UINT64_C(1000000);
+    pb->page->version = BUDDY_SHM_VERSION;
+    pb->page->page_size = sizeof(struct buddy_shm_page);
+    pb->page->pid = (int32_t)getpid();
+    pb->page->flags = pool->flags;
+    pb->page->pool_bytes = pool->numbytes;
+    pb->page->interval_ns = pb->interval_ns;
+
+    // The first snapshot goes in before the magic so a reader never sees
+    // an empty page
+    publish(pb);
+    __atomic_store_n(&pb->page->magic, BUDDY_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    pthread_mutex_init(&pb->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pb->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pool->publisher = pb;
+    int err = pthread_create(&pb->thread, NULL, publisher_thread, pb);
+    if (err) {
+        pool->publisher = NULL;
+        pthread_cond_destroy(&pb->wake);
+        pthread_mutex_destroy(&pb->lock);
+        munmap(pb->page, sizeof(struct buddy_shm_page));
+        shm_unlink(pb->name);
+        free(pb);
+        return err;
+    }
+    return 0;
+}
+
+void buddy_publish_stop(struct buddy_pool *pool) {
+    if (!pool || !pool->publisher) return;
+    struct buddy_publisher *pb = pool->publisher;
+
+    pthread_mutex_lock(&pb->lock);
+    pb->stop = true;
+    pthread_cond_signal(&pb->wake);
+    pthread_mutex_unlock(&pb->lock);
+    pthread_join(pb->thread, NULL);
+    pool->publisher = NULL;
+
+    pthread_cond_destroy(&pb->wake);
+    pthread_mutex_destroy(&pb->lock);
+    munmap(pb->page, sizeof(struct buddy_shm_page));
+    shm_unlink(pb->name);
+    free(pb);
+}
+
+/*
+ * Heap profiler. Sampled allocations are kept in a hash of samples by
+ * pointer and grouped by call stack in a hash of stacks, both chained
+ * and guarded by one mutex since samples are rare. In front of them sits
+ * a table of counters indexed by a hash of the pointer, bumped for every
+ * live sample, so a free only takes the lock when the counter for its
+ * pointer is non-zero. Each thread keeps its own countdown of bytes to the
+ * next sample and its own random state.
+ */
+#define HEAP_FILTER_BITS 15
+#define HEAP_SAMPLE_SLOTS 4096
+#define HEAP_STACK_SLOTS 4096
+
+struct heap_stack
+{
+    struct heap_stack *next;
+    uint64_t hash;
+    uint64_t live_count;
+    uint64_t live_bytes;
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    uint32_t depth;
+    void *pc[];
+};
+
+struct heap_sample
+{
+    struct heap_sample *next;
+    void *ptr;
+    size_t size;
+    struct heap_stack *stack;
+};
+
+struct buddy_heap_prof
+{
+    uint64_t interval;
+    pthread_mutex_t lock;       /*Guards samples and stacks*/
+    uint16_t filter[1 << HEAP_FILTER_BITS]; /*Live samples per pointer hash*/
+    struct heap_sample *samples[HEAP_SAMPLE_SLOTS];
+    struct heap_stack *stacks[HEAP_STACK_SLOTS];
+};
+
+static __thread int64_t heap_bytes_left;
+static __thread uint64_t heap_rng;
+static __thread uintptr_t heap_stack_lo;
+static __thread uintptr_t heap_stack_hi;
+
+static inline bool is_profiling(struct buddy_pool *pool) {
+    return pool && __builtin_expect(pool->heap_prof != NULL, 0);
+}
+
+static inline size_t heap_ptr_hash(void *ptr) {
+    return (size_t)(((uintptr_t)ptr >> 4) * UINT64_C(0x9e3779b97f4a7c15) >> 32);
+}
+
+/*
+ * Bytes to the next sample, exponential with the given mean. log2 of the
+ * uniform draw comes from its exponent bits and a quadratic fit of the
+ * mantissa, close enough for sampling and no libm needed.
+ */
+static int64_t heap_next_gap(uint64_t mean) {
+    if (!heap_rng) {
+        heap_rng = ((uint64_t)(uintptr_t)&heap_rng ^ now_ns()) | 1;
+    }
+    heap_rng ^= heap_rng >> 12;
+    heap_rng ^= heap_rng << 25;
+    heap_rng ^= heap_rng >> 27;
+    uint64_t r = heap_rng * UINT64_C(0x2545f4914f6cdd1d);
+
+    union { double d; uint64_t i; } u = { .d = ((double)(r >> 11) + 1.0) * 0x1p-53 };
+    int e = (int)((u.i >> 52) & 0x7ff) - 1023;
+    u.i = (u.i & ((UINT64_C(1) << 52) - 1)) | (UINT64_C(1023) << 52);
+    double log2u = e + (-0.34484843 * u.d + 2.02466578) * u.d - 1.67487759;
+    double gap = -log2u * 0.69314718 * (double)mean;
+    return gap < 1.0 ? 1 : (int64_t)gap;
+}
+
+/* Return addresses above the caller of the public entry point */
+static __attribute__((noinline)) uint32_t heap_backtrace(void **pc, uint32_t max) {
+    if (!heap_stack_hi) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+            return 0;
+        }
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        heap_stack_lo = (uintptr_t)addr;
+        heap_stack_hi = (uintptr_t)addr + size;
+    }
+
+    // The first two return addresses lead back into heap_sample and the
+    // public entry point
+    uint32_t skip = 2;
+    uint32_t n = 0;
+    uintptr_t *fp = __builtin_frame_address(0);
+    while (n < max && (uintptr_t)fp >= heap_stack_lo && (uintptr_t)(fp + 2) <= heap_stack_hi &&
+           !((uintptr_t)fp & (sizeof(void *) - 1))) {
+        uintptr_t *next = (uintptr_t *)fp[0];
+        if (!fp[1]) {
+            break;
+        }
+        if (skip) {
+            skip--;
+        } else {
+            pc[n++] = (void *)fp[1];
+        }
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+    return n;
+}
+
+static struct heap_stack *heap_stack_get(struct buddy_heap_prof *hp, void **pc, uint32_t depth) {
+    uint64_t hash = depth;
+    for (uint32_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)pc[i]) * UINT64_C(0x100000001b3);
+    }
+    struct heap_stack **slot = &hp->stacks[hash % HEAP_STACK_SLOTS];
+    for (struct heap_stack *st = *slot; st; st = st->next) {
+        if (st->hash == hash && st->depth == depth && !memcmp(st->pc, pc, depth * sizeof(void *))) {
+            return st;
+        }
+    }
+    struct heap_stack *st = calloc(1, sizeof(*st) + depth * sizeof(void *));
+    if (!st) {
         return NULL;
     }
-    
-    return buddy;
+    st->hash = hash;
+    st->depth = depth;
+    memcpy(st->pc, pc, depth * sizeof(void *));
+    st->next = *slot;
+    *slot = st;
+    return st;
 }
 
-void buddy_init(struct buddy_pool *pool, size_t size) {
-    if (!pool) return;
+static __attribute__((noinline)) void heap_sample(struct buddy_heap_prof *hp, void *ptr, size_t size) {
+    void *pc[BUDDY_HEAP_MAX_DEPTH];
+    uint32_t depth = heap_backtrace(pc, BUDDY_HEAP_MAX_DEPTH);
+    struct heap_sample *s = malloc(sizeof(*s));
+    if (!s) {
+        return;
+    }
+    s->ptr = ptr;
+    s->size = size;
 
-    // If size is 0, use DEFAULT_K
-    if (size == 0) {
-        size = UINT64_C(1) << DEFAULT_K;
+    pthread_mutex_lock(&hp->lock);
+    s->stack = heap_stack_get(hp, pc, depth);
+    if (!s->stack) {
+        pthread_mutex_unlock(&hp->lock);
+        free(s);
+        return;
     }
+    s->stack->live_count++;
+    s->stack->live_bytes += size;
+    s->stack->alloc_count++;
+    s->stack->alloc_bytes += size;
+    size_t h = heap_ptr_hash(ptr);
+    s->next = hp->samples[h % HEAP_SAMPLE_SLOTS];
+    hp->samples[h % HEAP_SAMPLE_SLOTS] = s;
+    __atomic_fetch_add(&hp->filter[h & ((1 << HEAP_FILTER_BITS) - 1)], 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hp->lock);
+}
 
-    // Calculate required kval
-    size_t kval = btok(size);
-    size_t actual_size = UINT64_C(1) << kval;
+/*
+ * Counts size bytes against this thread's countdown, sampling ptr when it
+ * runs out. Always inlined so heap_backtrace knows how many frames to skip.
+ */
+static inline __attribute__((always_inline)) void heap_account(struct buddy_pool *pool, void *ptr, size_t size) {
+    struct buddy_heap_prof *hp = pool->heap_prof;
+    heap_bytes_left -= (int64_t)size;
+    if (__builtin_expect(heap_bytes_left > 0, 1) || !ptr) {
+        return;
+    }
+    // A thread's first countdown starts here rather than at a sample
+    bool first = !heap_rng;
+    heap_bytes_left = heap_next_gap(hp->interval);
+    if (!first) {
+        heap_sample(hp, ptr, size);
+    }
+}
 
-    // Map memory
-    void *mem = mmap(NULL, actual_size, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (mem == MAP_FAILED) {
-        errno = ENOMEM;
+/* Drops the sample of a block about to be freed, if it has one */
+static inline void heap_forget(struct buddy_pool *pool, void *ptr) {
+    struct buddy_heap_prof *hp = pool->heap_prof;
+    size_t h = heap_ptr_hash(ptr);
+    uint16_t *count = &hp->filter[h & ((1 << HEAP_FILTER_BITS) - 1)];
+    if (__builtin_expect(!__atomic_load_n(count, __ATOMIC_RELAXED), 1)) {
         return;
     }
 
-    // Initialize pool
-    pool->kval_m = kval;
-    pool->numbytes = actual_size;
-    pool->base = mem;
+    pthread_mutex_lock(&hp->lock);
+    for (struct heap_sample **s = &hp->samples[h % HEAP_SAMPLE_SLOTS]; *s; s = &(*s)->next) {
+        if ((*s)->ptr == ptr) {
+            struct heap_sample *gone = *s;
+            *s = gone->next;
+            gone->stack->live_count--;
+            gone->stack->live_bytes -= gone->size;
+            __atomic_fetch_sub(count, 1, __ATOMIC_RELAXED);
+            free(gone);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hp->lock);
+}
 
-    // Initialize avail array
-    for (size_t i = 0; i <= MAX_K - 1; i++) {
-        pool->avail[i].tag = BLOCK_UNUSED;
-        pool->avail[i].kval = i;
-        pool->avail[i].next = &pool->avail[i];
-        pool->avail[i].prev = &pool->avail[i];
+int buddy_heap_profile_start(struct buddy_pool *pool, size_t interval) {
+    if (!pool || !pool->base) return EINVAL;
+    if (pool->heap_prof) return EBUSY;
+    struct buddy_heap_prof *hp = calloc(1, sizeof(*hp));
+    if (!hp) return ENOMEM;
+    hp->interval = interval ? interval : BUDDY_HEAP_DEFAULT_INTERVAL;
+    pthread_mutex_init(&hp->lock, NULL);
+    pool->heap_prof = hp;
+    return 0;
+}
+
+int buddy_heap_profile_dump(struct buddy_pool *pool, const char *path) {
+    if (!pool || !pool->heap_prof || !path) return EINVAL;
+    struct buddy_heap_prof *hp = pool->heap_prof;
+    FILE *out = fopen(path, "w");
+    if (!out) return errno;
+
+    // Totals go in the header line, pprof scales every line back up by
+    // the chance that an allocation of its average size was sampled
+    pthread_mutex_lock(&hp->lock);
+    uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < HEAP_STACK_SLOTS; i++) {
+        for (struct heap_stack *st = hp->stacks[i]; st; st = st->next) {
+            live_count += st->live_count;
+            live_bytes += st->live_bytes;
+            alloc_count += st->alloc_count;
+            alloc_bytes += st->alloc_bytes;
+        }
     }
+    fprintf(out, "heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%llu\n",
+            (unsigned long long)live_count, (unsigned long long)live_bytes,
+            (unsigned long long)alloc_count, (unsigned long long)alloc_bytes,
+            (unsigned long long)hp->interval);
+    for (size_t i = 0; i < HEAP_STACK_SLOTS; i++) {
+        for (struct heap_stack *st = hp->stacks[i]; st; st = st->next) {
+            fprintf(out, "%6llu: %8llu [%6llu: %8llu] @",
+                    (unsigned long long)st->live_count, (unsigned long long)st->live_bytes,
+                    (unsigned long long)st->alloc_count, (unsigned long long)st->alloc_bytes);
+            for (uint32_t d = 0; d < st->depth; d++) {
+                fprintf(out, " %p", st->pc[d]);
+            }
+            fputc('\n', out);
+        }
+    }
+    pthread_mutex_unlock(&hp->lock);
 
-    // Initialize base block
-    struct avail *base = (struct avail *)mem;
-    base->tag = BLOCK_AVAIL;
-    base->kval = kval;
-    base->next = &pool->avail[kval];
-    base->prev = &pool->avail[kval];
-    
-    // Link base block into avail array
-    pool->avail[kval].next = base;
-    pool->avail[kval].prev = base;
+    // The memory map lets pprof find the binary behind each address
+    fputs("\nMAPPED_LIBRARIES:\n", out);
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+        fclose(maps);
+    }
+    int err = ferror(out) ? EIO : 0;
+    if (fclose(out) != 0 && !err) {
+        err = errno;
+    }
+    return err;
 }
 
-void buddy_destroy(struct buddy_pool *pool) {
-    if (!pool || !pool->base) return;
-    munmap(pool->base, pool->numbytes);
-    pool->base = NULL;
+void buddy_heap_profile_stop(struct buddy_pool *pool) {
+    if (!pool || !pool->heap_prof) return;
+    struct buddy_heap_prof *hp = pool->heap_prof;
+    pool->heap_prof = NULL;
+    for (size_t i = 0; i < HEAP_SAMPLE_SLOTS; i++) {
+        while (hp->samples[i]) {
+            struct heap_sample *s = hp->samples[i];
+            hp->samples[i] = s->next;
+            free(s);
+        }
+    }
+    for (size_t i = 0; i < HEAP_STACK_SLOTS; i++) {
+        while (hp->stacks[i]) {
+            struct heap_stack *st = hp->stacks[i];
+            hp->stacks[i] = st->next;
+            free(st);
+        }
+    }
+    pthread_mutex_destroy(&hp->lock);
+    free(hp);
+}
+
+static void *root_malloc(struct buddy_pool *pool, size_t size) {
+    void *ptr = pool_malloc(pool, size);
+    if (!ptr && pool && pool->arenas && size) {
+        ptr = arena_alloc(pool, 0, size);
+    }
+    if (!ptr && pool && pool->base && size) {
+        STAT_ADD(pool, failures, 1);
+    }
+    return ptr;
 }
 
 void *buddy_malloc(struct buddy_pool *pool, size_t size) {
-    if (!pool || !pool->base || size == 0) {
-        errno = ENOMEM;
-        return NULL;
+    uint64_t t0 = lat_start(pool);
+    void *ptr = root_malloc(pool, size);
+    if (t0) {
+        // Failures are left to buddy_stats rather than filed as order 0
+        uint64_t cycles = lat_stop(t0);
+        if (ptr) {
+            lat_record(pool, BUDDY_LAT_MALLOC, trace_order(pool, ptr), cycles);
+        }
+    }
+    if (is_tracing(pool)) {
+        trace_op(pool, BUDDY_TRACE_MALLOC, ptr, 0, size);
+    }
+    if (is_profiling(pool)) {
+        heap_account(pool, ptr, size);
     }
+    return ptr;
+}
 
-    // Calculate required block size including header
-    size_t total_size = size + sizeof(struct avail);
-    size_t k = btok(total_size);
-    
-    // DEBUG_PRINT("Malloc request: %zu bytes (k=%zu)\n", size, k);
+void *buddy_aligned_alloc(struct buddy_pool *pool, size_t alignment, size_t size) {
+    void *ptr = pool_aligned_alloc(pool, alignment, size);
+    if (!ptr && errno == ENOMEM && pool && pool->arenas && size) {
+        ptr = arena_alloc(pool, alignment, size);
+    }
+    if (!ptr && errno == ENOMEM && pool && pool->base && size) {
+        STAT_ADD(pool, failures, 1);
+    }
+    if (is_tracing(pool)) {
+        trace_op(pool, BUDDY_TRACE_ALIGNED, ptr, alignment, size);
+    }
+    if (is_profiling(pool)) {
+        heap_account(pool, ptr, size);
+    }
+    return ptr;
+}
 
-    // Find smallest available block that fits
-    size_t current_k = k;
-    struct avail *block = NULL;
-    
-    while (current_k <= pool->kval_m) {
-        if (pool->avail[current_k].next != &pool->avail[current_k]) {
-            block = pool->avail[current_k].next;
+static size_t pool_malloc_batch(struct buddy_pool *pool, size_t size, size_t n, void **out) {
+    if (!pool || !pool->base || size == 0 || size > pool->numbytes) {
+        return 0;
+    }
+
+    // Tiny objects come out of slabs one at a time
+    size_t got = 0;
+    if (has_slab(pool) && size <= SLAB_MAX_SIZE) {
+        while (got < n && (out[got] = pool_malloc(pool, size))) {
+            got++;
+        }
+        return got;
+    }
+
+    // Drain the calling thread's cache before touching the lists
+    size_t hdr = header_size(pool);
+    size_t k = btok(size + hdr);
+    if (has_tcache(pool) && k <= pool->tcache_max_k) {
+        struct buddy_tcache *tc = tcache_get(pool);
+        while (tc && got < n && tc->head[k]) {
+            struct avail *block = tc->head[k];
+            tc->head[k] = block->next;
+            tc->count[k]--;
+            out[got++] = (char *)block + hdr;
+            STAT_ADD(pool, requested_bytes, size);
+            STAT_ADD(pool, reserved_bytes, UINT64_C(1) << k);
+            STAT_LIVE_BLOCK(pool, block, k, size);
+            STAT_ADD(pool, mallocs, 1);
+        }
+    }
+
+    // Carve the rest as siblings, up to 64 per round
+    struct avail *blocks[64];
+    while (got < n) {
+        size_t want = (n - got < 64) ? n - got : 64;
+        size_t carved = block_alloc_batch(pool, k, want, blocks);
+        for (size_t i = 0; i < carved; i++) {
+            out[got++] = (char *)blocks[i] + hdr;
+            STAT_LIVE_BLOCK(pool, blocks[i], k, size);
+        }
+        STAT_ADD(pool, requested_bytes, carved * size);
+        STAT_ADD(pool, reserved_bytes, carved << k);
+        STAT_ADD(pool, mallocs, carved);
+        if (carved < want && !(has_lazy(pool) && lazy_flush(pool))) {
             break;
         }
-        current_k++;
     }
+    return got;
+}
 
-    if (!block) {
-        errno = ENOMEM;
-        return NULL;
+size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t n, void **out) {
+    if (!out) {
+        errno = EINVAL;
+        return 0;
     }
+    size_t got = pool_malloc_batch(pool, size, n, out);
 
-    // Remove block from avail list
-    block->prev->next = block->next;
-    block->next->prev = block->prev;
+    // A growable pool carries on in its arenas, mapping more as needed
+    if (got < n && pool && pool->arenas && size) {
+        size_t count = __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE);
+        for (size_t i = count; got < n && i-- > 0;) {
+            got += pool_malloc_batch(pool->arenas->list[i], size, n - got, out + got);
+        }
+        while (got < n && (out[got] = arena_alloc(pool, 0, size))) {
+            got++;
+        }
+    }
+    if (got < n) {
+        errno = ENOMEM;
+        if (pool && pool->base && size) {
+            STAT_ADD(pool, failures, n - got);
+        }
+    }
+    for (size_t i = 0; is_tracing(pool) && i < got; i++) {
+        trace_op(pool, BUDDY_TRACE_MALLOC, out[i], 0, size);
+    }
+    for (size_t i = 0; is_profiling(pool) && i < got; i++) {
+        heap_account(pool, out[i], size);
+    }
+    return got;
+}
 
-    // Split block if necessary
-    while (current_k > k) {
-        current_k--;
-        
-        // Create buddy block
-        struct avail *buddy = (struct avail *)((char *)block + (UINT64_C(1) << current_k));
-        buddy->tag = BLOCK_AVAIL;
-        buddy->kval = current_k;
-        
-        // Add buddy to avail list
-        buddy->next = pool->avail[current_k].next;
-        buddy->prev = &pool->avail[current_k];
-        pool->avail[current_k].next->prev = buddy;
-        pool->avail[current_k].next = buddy;
-        
-        // Update original block
-        block->kval = current_k;
+int buddy_posix_memalign(struct buddy_pool *pool, void **memptr, size_t alignment, size_t size) {
+    if (!memptr || alignment % sizeof(void *) != 0) {
+        return EINVAL;
     }
 
-    // Mark block as reserved
-    block->tag = BLOCK_RESERVED;
-    
-    // DEBUG_PRINT("Allocated block at %p (k=%u)\n", block, block->kval);
-    
-    return (void *)(block + 1);
+    // posix_memalign reports through its return value and leaves errno alone
+    int saved = errno;
+    void *ptr = buddy_aligned_alloc(pool, alignment, size);
+    int err = ptr ? 0 : errno;
+    errno = saved;
+    if (ptr) {
+        *memptr = ptr;
+    }
+    return err;
 }
 
-void buddy_free(struct buddy_pool *pool, void *ptr) {
-    if (!pool || !ptr) return;
+static void pool_free(struct buddy_pool *pool, void *ptr) {
+    STAT_ADD(pool, frees, 1);
+
+    // Slab objects go back to the slab that owns their page
+    if (has_slab(pool)) {
+        struct buddy_slab *slab = slab_of(pool, ptr);
+        if (slab) {
+            slab_free(pool, slab, ptr);
+            return;
+        }
+    }
 
     // Get block header
-    struct avail *block = ((struct avail *)ptr) - 1;
+    struct avail *block = ptr_to_block(pool, ptr);
     
     // DEBUG_PRINT("Freeing block at %p (k=%u)\n", block, block->kval);
 
-    // Mark block as available
-    block->tag = BLOCK_AVAIL;
-
-    // Coalesce with buddy if possible
-    while (block->kval < pool->kval_m) {
-        struct avail *buddy = buddy_calc(pool, block);
-        
-        // Check if buddy is available for merging
-        if (!buddy || buddy->tag != BLOCK_AVAIL || buddy->kval != block->kval) {
-            break;
+    // Small orders go back to the calling thread's cache, trimmed back to
+    // half the high-water mark once they cross it
+    size_t k = meta_kval(pool, block);
+    STAT_DEAD_BLOCK(pool, block, k);
+    if (has_tcache(pool) && k <= pool->tcache_max_k) {
+        struct buddy_tcache *tc = tcache_get(pool);
+        if (tc) {
+            block->next = tc->head[k];
+            tc->head[k] = block;
+            if (++tc->count[k] > pool->tcache_high) {
+                tcache_flush_order(pool, tc, k, pool->tcache_high / 2);
+            }
+            return;
         }
+    }
 
-        // Remove buddy from its avail list
-        buddy->prev->next = buddy->next;
-        buddy->next->prev = buddy->prev;
+    if (has_lazy(pool)) {
+        lazy_push(pool, block, k);
+        return;
+    }
+    block_free(pool, block);
+}
 
-        // Choose the lower address as the new block
-        if (buddy < block) {
-            block = buddy;
+static void root_free(struct buddy_pool *pool, void *ptr) {
+
+    // Memory from an extra arena goes back to that arena, which may then
+    // be unmapped once nothing in it is in use
+    struct buddy_pool *owner = owner_of(pool, ptr);
+    if (!owner) return;
+    pool_free(owner, ptr);
+    if (owner != pool && !is_concurrent(pool) && arena_is_free(owner)) {
+        arena_release(pool, owner);
+    }
+}
+
+void buddy_free(struct buddy_pool *pool, void *ptr) {
+    if (!pool || !ptr) return;
+    if (is_tracing(pool)) {
+        trace_op(pool, BUDDY_TRACE_FREE, ptr, 0, 0);
+    }
+    if (is_profiling(pool)) {
+        heap_forget(pool, ptr);
+    }
+    if (is_timed(pool)) {
+        // The order has to be read while the block is still reserved
+        size_t k = trace_order(pool, ptr);
+        uint64_t t0 = lat_start(pool);
+        root_free(pool, ptr);
+        lat_record(pool, BUDDY_LAT_FREE, k, lat_stop(t0));
+        return;
+    }
+    root_free(pool, ptr);
+}
+
+/* Frees every pointer in ptrs that lies in this pool, see block_free_batch */
+static void pool_free_batch(struct buddy_pool *pool, void **ptrs, size_t n) {
+    uint64_t stack_buf[3 * FREE_BATCH_STACK];
+    uint64_t *keys = stack_buf;
+    if (n > FREE_BATCH_STACK) {
+        keys = malloc(3 * n * sizeof(uint64_t));
+        if (!keys) {
+            for (size_t i = 0; i < n; i++) {
+                if (ptrs[i] && in_pool(pool, ptrs[i])) {
+                    pool_free(pool, ptrs[i]);
+                }
+            }
+            return;
         }
+    }
+    uint64_t *run = keys + n;
 
-        // Update block size
-        block->kval++;
+    // Slab objects go back one by one, blocks are collected for sorting
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!ptrs[i] || !in_pool(pool, ptrs[i])) {
+            continue;
+        }
+        struct buddy_slab *slab = has_slab(pool) ? slab_of(pool, ptrs[i]) : NULL;
+        if (slab) {
+            slab_free(pool, slab, ptrs[i]);
+            STAT_ADD(pool, frees, 1);
+            continue;
+        }
+        struct avail *block = ptr_to_block(pool, ptrs[i]);
+        STAT_DEAD_BLOCK(pool, block, meta_kval(pool, block));
+        keys[m++] = FREE_KEY(meta_kval(pool, block), (uintptr_t)block - (uintptr_t)pool->base);
+    }
+    STAT_ADD(pool, frees, m);
+    block_free_batch(pool, keys, m, run);
+    if (keys != stack_buf) {
+        free(keys);
+    }
+}
+
+void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t n) {
+    if (!pool || !pool->base || !ptrs || !n) return;
+    for (size_t i = 0; is_tracing(pool) && i < n; i++) {
+        if (ptrs[i]) {
+            trace_op(pool, BUDDY_TRACE_FREE, ptrs[i], 0, 0);
+        }
+    }
+    for (size_t i = 0; is_profiling(pool) && i < n; i++) {
+        if (ptrs[i]) {
+            heap_forget(pool, ptrs[i]);
+        }
     }
+    pool_free_batch(pool, ptrs, n);
+    if (!pool->arenas) return;
 
-    // Add block to appropriate avail list
-    block->next = pool->avail[block->kval].next;
-    block->prev = &pool->avail[block->kval];
-    pool->avail[block->kval].next->prev = block;
-    pool->avail[block->kval].next = block;
+    // Each arena picks out its own pointers. Going from the newest down
+    // keeps the walk valid while empty arenas are released.
+    size_t count = __atomic_load_n(&pool->arenas->count, __ATOMIC_ACQUIRE);
+    for (size_t i = count; i-- > 0;) {
+        struct buddy_pool *arena = pool->arenas->list[i];
+        pool_free_batch(arena, ptrs, n);
+        if (!is_concurrent(pool) && arena_is_free(arena)) {
+            arena_release(pool, arena);
+        }
+    }
 }
 
-void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size) {
-    if (!pool) {
+static void *root_realloc(struct buddy_pool *root, void *ptr, size_t size) {
+    if (!root) {
         errno = ENOMEM;
         return NULL;
     }
 
     // Handle special cases
-    if (!ptr) return buddy_malloc(pool, size);
+    if (!ptr) return root_malloc(root, size);
     if (size == 0) {
-        buddy_free(pool, ptr);
+        root_free(root, ptr);
         return NULL;
     }
 
-    // Get current block information
-    struct avail *old_block = ((struct avail *)ptr) - 1;
-    size_t old_size = (UINT64_C(1) << old_block->kval) - sizeof(struct avail);
+    // Resizing in place happens in the arena that owns the block, a move
+    // can land anywhere in the pool
+    struct buddy_pool *pool = owner_of(root, ptr);
+    if (!pool) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    // If new size fits in current block, just return the same pointer
-    size_t new_k = btok(size + sizeof(struct avail));
-    if (new_k <= old_block->kval) {
+    // Slab objects can only stay put while the new size fits their class
+    struct buddy_slab *slab = has_slab(pool) ? slab_of(pool, ptr) : NULL;
+    if (slab && size <= slab->size) {
+        STAT_DEAD_OBJ(pool, ptr, slab->size);
+        STAT_LIVE_OBJ(pool, ptr, slab->size, size);
         return ptr;
     }
 
+    // Get current block information
+    size_t old_size = slab ? slab->size : 0;
+    if (!slab) {
+        struct avail *old_block = ptr_to_block(pool, ptr);
+        size_t hdr = (size_t)((char *)ptr - (char *)old_block);
+        size_t old_k = meta_kval(pool, old_block);
+        old_size = (UINT64_C(1) << old_k) - hdr;
+        size_t new_k = (size <= pool->numbytes) ? btok(size + hdr) : MAX_K;
+
+        // If new size fits in current block, just return the same pointer
+        if (new_k == old_k) {
+            STAT_DEAD_BLOCK(pool, old_block, old_k);
+            STAT_LIVE_BLOCK(pool, old_block, old_k, size);
+            return ptr;
+        }
+
+        // Shrinking hands the trailing halves back to the pool, growing
+        // absorbs free upper buddies in place when they are there. Either
+        // way a headered block keeps its in-band kval in step.
+        bool in_place = true;
+        if (new_k < old_k) {
+            block_shrink(pool, old_block, old_k, new_k);
+        } else {
+            in_place = block_grow(pool, old_block, old_k, new_k);
+        }
+        if (hdr) {
+            old_block->kval = meta_kval(pool, old_block);
+        }
+        if (in_place) {
+            STAT_DEAD_BLOCK(pool, old_block, old_k);
+            STAT_LIVE_BLOCK(pool, old_block, new_k, size);
+            return ptr;
+        }
+    }
+
     // Allocate new block
-    void *new_ptr = buddy_malloc(pool, size);
+    void *new_ptr = root_malloc(root, size);
     if (!new_ptr) {
         return NULL;
     }
@@ -227,7 +3440,34 @@ void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size) {
     memcpy(new_ptr, ptr, old_size);
     
     // Free old block
-    buddy_free(pool, ptr);
+    root_free(root, ptr);
+
+    return new_ptr;
+}
 
+void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size) {
+    // The old block may be freed and handed to another thread inside, so
+    // its sample goes first; the result is sampled like a new allocation
+    if (ptr && is_profiling(pool)) {
+        heap_forget(pool, ptr);
+    }
+    // Claim the record's place before the old block can be freed, like
+    // buddy_free, so another thread that gets the address back is logged
+    // after this call
+    uint64_t pos = is_tracing(pool) ? trace_claim(pool->trace) : UINT64_MAX;
+    uint64_t t0 = lat_start(pool);
+    void *new_ptr = root_realloc(pool, ptr, size);
+    if (t0) {
+        uint64_t cycles = lat_stop(t0);
+        if (new_ptr) {
+            lat_record(pool, BUDDY_LAT_REALLOC, trace_order(pool, new_ptr), cycles);
+        }
+    }
+    if (is_tracing(pool)) {
+        trace_publish(pool, pos, BUDDY_TRACE_REALLOC, new_ptr, (uintptr_t)ptr, size);
+    }
+    if (is_profiling(pool)) {
+        heap_account(pool, new_ptr, size);
+    }
     return new_ptr;
-}
\ No newline at end of file
+}
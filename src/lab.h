@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 
 #ifdef __cplusplus
@@ -28,15 +29,156 @@ extern "C"
    */
 #define MAX_K 48
 
+  /**
+   * buddy_init aligns the pool's base address to the pool size so blocks
+   * are aligned to their size in virtual memory. If that much address space
+   * cannot be reserved it falls back to aligning to 2^BASE_ALIGN_MIN_K.
+   */
+#ifndef BASE_ALIGN_MIN_K
+#define BASE_ALIGN_MIN_K 21
+#endif
+
   /**
    * The smallest memory block size that can be returned by buddy_malloc value must
    * be large enough to account for the avail header.
    */
 #define SMALLEST_K 6
 
+  /**
+   * Flags for buddy_init_flags.
+   */
+#define BUDDY_CONCURRENT   0x1  /*Guard each avail[] list with its own lock*/
+#define BUDDY_THREAD_CACHE 0x2  /*Serve small orders from per-thread caches*/
+#define BUDDY_HEADERLESS   0x4  /*Hand out whole blocks with no in-band header*/
+#define BUDDY_SLAB         0x8  /*Serve tiny requests from slabs of buddy pages*/
+#define BUDDY_GROWABLE     0x10 /*Map more arenas when the pool runs out*/
+#define BUDDY_LAZY         0x20 /*Park freed blocks and coalesce them later*/
+
+  /**
+   * Most arenas a BUDDY_GROWABLE pool chains behind its own memory.
+   */
+#define BUDDY_MAX_ARENAS 64
+
+  /**
+   * Mapping options for buddy_init_ex.
+   */
+#define BUDDY_MAP_HUGETLB  0x1  /*Back the pool with MAP_HUGETLB pages*/
+#define BUDDY_MAP_THP      0x2  /*Ask for transparent huge pages with MADV_HUGEPAGE*/
+#define BUDDY_MAP_POPULATE 0x4  /*Fault the whole pool in from the calling thread*/
+#define BUDDY_MAP_PREFAULT 0x8  /*Fault the whole pool in from several threads*/
+#define BUDDY_MAP_LOCKED   0x10 /*Lock the pool in RAM*/
+#define BUDDY_MAP_NORESERVE 0x20 /*Reserve address space only, no swap or commit charge*/
+
+  /**
+   * Huge page size assumed for BUDDY_MAP_HUGETLB, the kernel default on x86-64.
+   */
+#define BUDDY_HUGE_K 21
+
+  /**
+   * Slab layer geometry. Slabs are 2^SLAB_K byte pages split into objects
+   * of one size class: SLAB_MIN_SIZE, doubling up to SLAB_MAX_SIZE.
+   */
+#define SLAB_K            12
+#define SLAB_MIN_SIZE     8
+#define SLAB_MAX_SIZE     32
+#define SLAB_CLASSES      3
+#define SLAB_BITMAP_WORDS 8
+
+  /**
+   * Defaults for the per-thread caches, see buddy_thread_cache_config.
+   */
+#define TCACHE_DEFAULT_MAX_K 12
+#define TCACHE_DEFAULT_HIGH  32
+
+  /**
+   * Default number of parked blocks per order for BUDDY_LAZY, see
+   * buddy_lazy_config.
+   */
+#define LAZY_DEFAULT_HIGH 64
+
+  /**
+   * Pool statistics, see buddy_stats. The counters are kept up to date by
+   * every allocation and free; build with -DBUDDY_STATS=0 to compile them
+   * out entirely.
+   */
+#ifndef BUDDY_STATS
+#define BUDDY_STATS 1
+#endif
+
+  /**
+   * Allocation trace format, see buddy_trace_start. A trace file is a
+   * struct buddy_trace_header followed by struct buddy_trace_record
+   * entries in the order the calls were made.
+   */
+#define BUDDY_TRACE_MAGIC   0x4352545944445542ULL /*"BUDDYTRC" little endian*/
+#define BUDDY_TRACE_VERSION 1
+#define BUDDY_TRACE_DEFAULT_RECORDS (1u << 16)
+
+#define BUDDY_TRACE_MALLOC  1  /*buddy_malloc, and each object of buddy_malloc_batch*/
+#define BUDDY_TRACE_FREE    2  /*buddy_free, and each pointer of buddy_free_batch*/
+#define BUDDY_TRACE_REALLOC 3  /*buddy_realloc, old_id holds the pointer passed in*/
+#define BUDDY_TRACE_ALIGNED 4  /*buddy_aligned_alloc, old_id holds the alignment*/
+
+  /**
+   * Per-operation latency histograms, see buddy_latency_start. Compiled in
+   * by default and off until started; build with -DBUDDY_LATENCY=0 to
+   * remove the timing from every call. What timing adds to a call once
+   * started depends on the platform: reading the counter costs a few
+   * nanoseconds where the CPU hands it out directly, but it traps under
+   * some hypervisors and falls back to clock_gettime elsewhere, which can
+   * cost tens of nanoseconds per read.
+   */
+#ifndef BUDDY_LATENCY
+#define BUDDY_LATENCY 1
+#endif
+
+#define BUDDY_LAT_MALLOC  0    /*buddy_malloc*/
+#define BUDDY_LAT_FREE    1    /*buddy_free*/
+#define BUDDY_LAT_REALLOC 2    /*buddy_realloc*/
+#define BUDDY_LAT_OPS     3
+#define BUDDY_LAT_ALL_ORDERS MAX_K /*Order argument of buddy_latency_read for every order*/
+
+  /**
+   * Histogram buckets are log-linear in cycles: values below
+   * 2^BUDDY_LAT_SUB_BITS get a bucket each and every power of two above
+   * that is split into 2^BUDDY_LAT_SUB_BITS buckets, so a bucket is never
+   * wider than 1/8 of the values in it.
+   */
+#define BUDDY_LAT_SUB_BITS 3
+#define BUDDY_LAT_BUCKETS  (64 << BUDDY_LAT_SUB_BITS)
+
+  /**
+   * Shared memory stats page, see buddy_publish_start. The page is named
+   * BUDDY_SHM_PREFIX followed by the pid of the process unless a name is
+   * given.
+   */
+#define BUDDY_SHM_MAGIC   0x504f545944445542ULL /*"BUDDYTOP" little endian*/
+#define BUDDY_SHM_VERSION 2
+#define BUDDY_SHM_PREFIX  "/buddy."
+#define BUDDY_SHM_DEFAULT_MS 500
+
+  /**
+   * Heap profiler, see buddy_heap_profile_start. On average one allocation
+   * is sampled per BUDDY_HEAP_DEFAULT_INTERVAL bytes requested, and each
+   * sample keeps up to BUDDY_HEAP_MAX_DEPTH return addresses.
+   */
+#define BUDDY_HEAP_DEFAULT_INTERVAL (512u * 1024)
+#define BUDDY_HEAP_MAX_DEPTH 64
+
 #define BLOCK_AVAIL    1  /*Block is available to allocate*/
 #define BLOCK_RESERVED 0  /*Block has been handed to user*/
 #define BLOCK_UNUSED   3  /*Block is not used at all*/
+#define BLOCK_SLAB     2  /*Block is a page owned by the slab layer*/
+
+  /**
+   * Encoding of the out-of-band metadata byte kept for each block in
+   * buddy_pool.meta: the block state (BLOCK_AVAIL, BLOCK_RESERVED or
+   * BLOCK_SLAB) in the top two bits and the kval in the low six. A byte of
+   * 0 marks a slot that is not the start of a block.
+   */
+#define BLOCK_META_KVAL_MASK 0x3f
+#define BLOCK_META(state, k) ((uint8_t)(((state) << 6) | (k)))
+#define BLOCK_META_STATE(meta) ((meta) >> 6)
 
   /**
    * Struct to represent the table of all available blocks do not reorder members
@@ -50,6 +192,171 @@ extern "C"
     struct avail *prev;         /*prev memory block*/
   };
 
+  /**
+   * Options for buddy_init_ex.
+   */
+  struct buddy_init_opts
+  {
+    size_t size;                /*Size of the pool in bytes, 0 for the default*/
+    unsigned int flags;         /*BUDDY_* flags, as for buddy_init_flags*/
+    unsigned int map;           /*BUDDY_MAP_* options to try*/
+    unsigned int prefault_threads; /*Threads for BUDDY_MAP_PREFAULT, 0 for one per CPU*/
+    size_t arena_size;          /*Size of each extra BUDDY_GROWABLE arena, 0 for size*/
+    unsigned int applied;       /*Out: the BUDDY_MAP_* options that took effect*/
+  };
+
+  /**
+   * Memory handed back to the OS by the purge policy, see buddy_purge_config.
+   */
+  struct buddy_purge_stats
+  {
+    size_t resident_bytes;      /*Pool bytes that are not currently purged*/
+    size_t purged_bytes;        /*Bytes of free blocks currently purged*/
+    size_t purged_total;        /*Bytes purged since init, including reused ones*/
+  };
+
+  /**
+   * Pool statistics reported by buddy_stats. Reserved blocks are those off
+   * the free lists, including blocks held by thread caches, BUDDY_LAZY
+   * lists and slab pages. requested_bytes and reserved_bytes only ever
+   * grow; the live pair covers just what callers hold right now, so
+   * 1 - live_requested_bytes / live_reserved_bytes is the current
+   * internal fragmentation.
+   */
+  struct buddy_stats
+  {
+    size_t free_blocks[MAX_K];  /*Blocks of each order on the free lists*/
+    size_t alloc_blocks[MAX_K]; /*Blocks of each order reserved from the lists*/
+    size_t free_bytes;          /*Bytes on the free lists*/
+    size_t alloc_bytes;         /*Bytes reserved from the lists*/
+    size_t peak_bytes;          /*Highest alloc_bytes seen, across the pool and its arenas at once*/
+    size_t requested_bytes;     /*Bytes asked for by every allocation so far*/
+    size_t reserved_bytes;      /*Bytes handed out to satisfy those requests*/
+    size_t live_requested_bytes; /*Bytes asked for by the allocations not yet freed*/
+    size_t live_reserved_bytes; /*Bytes of the blocks and slab objects holding them*/
+    size_t largest_free_k;      /*Order of the largest free block, 0 if none*/
+    size_t splits;              /*Blocks split in two*/
+    size_t coalesces;           /*Buddy pairs merged into one block*/
+    size_t failures;            /*Allocations that failed with ENOMEM*/
+    size_t mallocs;             /*Allocations served, a realloc that moves counts as one*/
+    size_t frees;               /*Blocks and objects freed, a realloc that moves counts as one*/
+    size_t lock_waits[MAX_K];   /*Order lock acquisitions that had to wait, BUDDY_CONCURRENT only*/
+    size_t flight_waits;        /*Times an allocation yielded for a split or merge in flight*/
+    double fragmentation;       /*1 - largest free block / free_bytes, 0 if nothing is free*/
+  };
+
+  /**
+   * Counters behind buddy_stats, kept per pool and per arena.
+   */
+  struct buddy_counters
+  {
+    size_t free_blocks[MAX_K];  /*Updated under the order lock*/
+    size_t alloc_blocks[MAX_K];
+    size_t alloc_bytes;
+    size_t total_bytes;         /*alloc_bytes of a growable pool and its arenas, on the pool only*/
+    size_t peak_bytes;          /*Highest total_bytes, or alloc_bytes without arenas, on the pool only*/
+    size_t requested_bytes;
+    size_t reserved_bytes;
+    size_t live_requested;
+    size_t live_reserved;
+    size_t splits;
+    size_t coalesces;
+    size_t failures;
+    size_t mallocs;
+    size_t frees;
+    size_t lock_waits[MAX_K];
+    size_t flight_waits;
+  };
+
+  /**
+   * First bytes of a trace file.
+   */
+  struct buddy_trace_header
+  {
+    uint64_t magic;             /*BUDDY_TRACE_MAGIC*/
+    uint32_t version;           /*BUDDY_TRACE_VERSION*/
+    uint32_t record_size;       /*sizeof(struct buddy_trace_record)*/
+    uint64_t pool_bytes;        /*Size of the traced pool*/
+    uint32_t flags;             /*BUDDY_* flags of the traced pool*/
+    uint32_t reserved;
+  };
+
+  /**
+   * One traced call. Pointers are recorded as ids: the address itself,
+   * unique among live blocks, or 0 for a failed allocation.
+   */
+  struct buddy_trace_record
+  {
+    uint64_t ts_ns;             /*CLOCK_MONOTONIC time of the call*/
+    uint64_t id;                /*Pointer returned, or the one freed*/
+    uint64_t old_id;            /*See the BUDDY_TRACE_* ops, 0 otherwise*/
+    uint64_t size;              /*Requested size, 0 for frees*/
+    uint8_t op;                 /*BUDDY_TRACE_* op*/
+    uint8_t order;              /*Order of the block, 0 for slab objects and failures*/
+    uint16_t unused[3];
+  };
+
+  /**
+   * Latency of one operation on one order, see buddy_latency_read. Cycles
+   * are those of the counter buddy_latency_cycles_per_ns calibrates. The
+   * depth histograms count calls by how many splits or coalesces they
+   * caused, including those of blocks moved by a thread cache refill or
+   * flush; depths of MAX_K - 1 and more share the last entry.
+   */
+  struct buddy_latency
+  {
+    uint64_t count;             /*Calls timed*/
+    uint64_t cycles;            /*Sum of their latencies*/
+    uint64_t max;               /*Slowest call*/
+    uint64_t buckets[BUDDY_LAT_BUCKETS]; /*Calls by latency*/
+    uint64_t split_depth[MAX_K];    /*Calls by number of blocks split*/
+    uint64_t coalesce_depth[MAX_K]; /*Calls by number of buddy pairs merged*/
+  };
+
+  /**
+   * Layout of the shared memory page a pool publishes its counters to.
+   * The publisher makes seq odd before it rewrites the snapshot and even
+   * again once it is done, so a reader copies the page and keeps the copy
+   * only when seq was the same even number before and after.
+   */
+  struct buddy_shm_page
+  {
+    uint64_t magic;             /*BUDDY_SHM_MAGIC*/
+    uint32_t version;           /*BUDDY_SHM_VERSION*/
+    uint32_t page_size;         /*sizeof(struct buddy_shm_page)*/
+    uint64_t seq;               /*Odd while a snapshot is being written*/
+    int32_t pid;                /*Process that owns the pool*/
+    uint32_t flags;             /*BUDDY_* flags of the pool*/
+    uint64_t pool_bytes;        /*Size of the pool, without arenas*/
+    uint64_t interval_ns;       /*How often the snapshot is refreshed*/
+    uint64_t updated_ns;        /*CLOCK_MONOTONIC time of the last snapshot*/
+    uint64_t updates;           /*Snapshots written so far*/
+    uint64_t arenas;            /*Extra arenas of a BUDDY_GROWABLE pool*/
+    double malloc_rate;         /*Allocations per second since the previous snapshot*/
+    double free_rate;           /*Frees per second since the previous snapshot*/
+    uint64_t purge_k;           /*Smallest order purged, 0 when purging is off*/
+    uint64_t purge_decay_ns;    /*How long a block stays free before it is purged*/
+    struct buddy_purge_stats purge;
+    struct buddy_stats stats;
+  };
+
+  /**
+   * Lock for a single avail[] list. Padded to a cache line so threads
+   * working on neighbouring orders do not share one.
+   */
+  struct buddy_lock
+  {
+    pthread_mutex_t mutex;
+  } __attribute__((aligned(64)));
+
+  struct buddy_tcache;
+  struct buddy_slab;
+  struct buddy_arenas;
+  struct buddy_trace;
+  struct buddy_lat;
+  struct buddy_publisher;
+  struct buddy_heap_prof;
+
   /**
    * The buddy memory pool.
    */
@@ -58,7 +365,40 @@ extern "C"
     size_t kval_m;              /*The max kval of this pool*/
     size_t numbytes;            /*The number of bytes this pool is managing*/
     void *base;                 /*Base address used to scale memory for buddy calculations*/
+    uint64_t avail_bits;        /*Bit k is set when avail[k] holds at least one free block*/
+    size_t in_flight;           /*Splits and merges holding memory off the lists, BUDDY_CONCURRENT only*/
+    uint8_t *meta;              /*One BLOCK_META byte per 2^SMALLEST_K bytes of the pool*/
+    unsigned int flags;         /*BUDDY_* flags the pool was initialized with*/
+    unsigned int map;           /*BUDDY_MAP_* options that took effect*/
+    struct buddy_arenas *arenas; /*Extra arenas of a BUDDY_GROWABLE pool, NULL otherwise*/
+    size_t arena_k;             /*Order of each extra arena*/
+    struct buddy_pool *home;    /*The growable pool an arena belongs to, NULL otherwise*/
     struct avail avail[MAX_K];  /*The array of available memory blocks*/
+    struct buddy_lock locks[MAX_K]; /*Per-order locks, only used with BUDDY_CONCURRENT*/
+    size_t tcache_max_k;        /*Largest order served from thread caches*/
+    unsigned int tcache_high;   /*Blocks per order a thread cache may hold*/
+    pthread_key_t tcache_key;   /*Finds the calling thread's cache*/
+    pthread_mutex_t tcache_lock; /*Guards the tcaches list*/
+    struct buddy_tcache *tcaches; /*Caches of every thread that used the pool*/
+    struct buddy_slab *slabs[SLAB_CLASSES]; /*Slabs with free objects, per size class*/
+    struct buddy_lock slab_locks[SLAB_CLASSES]; /*Per-class locks, only used with BUDDY_CONCURRENT*/
+    struct avail *lazy[MAX_K];  /*Recently freed blocks not yet coalesced, BUDDY_LAZY only*/
+    unsigned int lazy_count[MAX_K]; /*Number of blocks on each lazy list*/
+    unsigned int lazy_high;     /*Parked blocks per order before the oldest are coalesced*/
+    size_t purge_k;             /*Free blocks of this order and up get purged, 0 disables*/
+    uint64_t purge_decay_ns;    /*How long a block must stay free before it is purged*/
+    int purge_advice;           /*MADV_FREE or MADV_DONTNEED*/
+    uint64_t purge_last_ns;     /*When the last purge sweep ran*/
+    size_t purged_bytes;        /*Bytes of free blocks currently handed back to the OS*/
+    size_t purged_total;        /*Bytes handed back to the OS since init*/
+    struct buddy_trace *trace;  /*Trace recorder, NULL unless buddy_trace_start ran*/
+    struct buddy_lat *latency;  /*Latency histograms, NULL unless buddy_latency_start ran*/
+    struct buddy_publisher *publisher; /*Stats page writer, NULL unless buddy_publish_start ran*/
+    struct buddy_heap_prof *heap_prof; /*Heap profiler, NULL unless buddy_heap_profile_start ran*/
+#if BUDDY_STATS
+    struct buddy_counters stats; /*Usage counters, see buddy_stats*/
+    uint32_t *slack;            /*Unused bytes of each live block or slab object, behind meta*/
+#endif
   };
 
   /**
@@ -68,6 +408,15 @@ extern "C"
    */
   size_t btok(size_t bytes);
 
+  /**
+   * Converts an array of byte counts to K values. Produces exactly what
+   * calling btok on each element would, in a single branch free loop.
+   * @param bytes The sizes to convert
+   * @param kvals Output array receiving one K value per size
+   * @param n The number of elements in bytes and kvals
+   */
+  void btok_batch(const size_t *bytes, size_t *kvals, size_t n);
+
 
   /**
    * Find the buddy of a given pointer and kval relative to the base address we got from mmap
@@ -91,6 +440,55 @@ extern "C"
    */
   void *buddy_malloc(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Allocates size bytes aligned to alignment, which must be a power of
+   * two. Blocks of the pool are naturally aligned to their own size, so the
+   * block itself is returned without its in-band header and no bigger
+   * than max(size, alignment) rounded up to a power of two. The result is
+   * released with buddy_free like any other pointer from the pool.
+   *
+   * Alignments beyond the alignment of the pool's base address cannot be
+   * honoured and fail with EINVAL. buddy_init aligns the base to the pool
+   * size, so in practice that is only alignments larger than the pool.
+   *
+   * @param pool The memory pool to alloc from
+   * @param alignment The required alignment in bytes, a power of two
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block, NULL with errno set on failure
+   */
+  void *buddy_aligned_alloc(struct buddy_pool *pool, size_t alignment, size_t size);
+
+  /**
+   * posix_memalign for a buddy pool. Stores an allocation of size bytes
+   * aligned to alignment in *memptr.
+   *
+   * @param pool The memory pool to alloc from
+   * @param memptr Receives the pointer on success, untouched on failure
+   * @param alignment A power of two multiple of sizeof(void *)
+   * @param size The size of the user requested memory block in bytes
+   * @return 0 on success, EINVAL for a bad alignment or ENOMEM
+   */
+  int buddy_posix_memalign(struct buddy_pool *pool, void **memptr, size_t alignment, size_t size);
+
+  /**
+   * Allocates n objects of the same size in one call. Rather than
+   * searching and splitting once per object, the pool pops one block
+   * large enough for all of them and splits it into n sibling blocks,
+   * pushing back only what is left over. Each object is freed on its own
+   * with buddy_free.
+   *
+   * When the pool cannot satisfy all n the objects it could allocate are
+   * still returned, in out[0] up to the returned count, and errno is set
+   * to ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of each object in bytes
+   * @param n The number of objects wanted
+   * @param out Receives the objects, room for n pointers
+   * @return The number of objects allocated, n on full success
+   */
+  size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t n, void **out);
+
   /**
    * A block of memory previously allocated by a call to malloc,
    * calloc or realloc is deallocated, making it available again
@@ -108,6 +506,21 @@ extern "C"
    */
   void buddy_free(struct buddy_pool *pool, void *ptr);
 
+  /**
+   * Frees n blocks at once, as buddy_free would one by one. The blocks
+   * are sorted by size and address and coalesced bottom-up one order at a
+   * time, so a parent formed from two blocks of the batch is built once
+   * instead of being merged and checked again by every later free. Blocks
+   * go straight back to the pool, bypassing the thread caches, and batches
+   * too small to share many parents are simply freed in turn. Null
+   * entries are skipped.
+   *
+   * @param pool The memory pool
+   * @param ptrs The blocks to free
+   * @param n The number of entries in ptrs
+   */
+  void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t n);
+
   /**
    * Changes the size of the memory block pointed to by ptr.
    * The function may move the memory block to a new location
@@ -117,6 +530,11 @@ extern "C"
    * moved to a new location. If the new size is larger,
    * the value of the newly allocated portion is indeterminate.
    *
+   * The block is resized in place whenever it can be. Shrinking to a
+   * smaller order splits off the trailing halves and returns them to the
+   * pool. Growing absorbs the free upper buddies of the block when they
+   * are available and only copies when they are not.
+   *
    * In case that ptr is a null pointer, the function behaves
    * like malloc, assigning a new block of size bytes and
    * returning a pointer to its beginning.
@@ -136,7 +554,9 @@ extern "C"
    * this function uses mmap to get a block of memory to manage so should be
    * portable to any system that implements mmap. This function will round
    * up to the nearest power of two. So if the user requests 503MiB
-   * it will be rounded up to 512MiB.
+   * it will be rounded up to 512MiB. The memory is placed on a boundary of
+   * its own size (see BASE_ALIGN_MIN_K), so a block of 2^k bytes is always
+   * 2^k aligned in virtual memory.
    *
    * Note that if a 0 is passed as an argument then it initializes
    * the memory pool to be of the default size of DEFAULT_K. If the caller
@@ -152,6 +572,333 @@ extern "C"
    */
   void buddy_init(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Same as buddy_init but with a set of BUDDY_* flags.
+   *
+   * BUDDY_CONCURRENT makes buddy_malloc, buddy_free and buddy_realloc safe
+   * to call from multiple threads at once. Each avail[] list gets its own
+   * lock instead of the caller serializing every call on one mutex. A call
+   * that finds no free block while another thread is splitting or
+   * coalescing waits for it to finish instead of reporting ENOMEM.
+   *
+   * BUDDY_THREAD_CACHE puts a cache of ready made blocks for the small
+   * orders in front of the pool for each thread, so most malloc/free pairs
+   * never touch the shared lists. Combine it with BUDDY_CONCURRENT when
+   * more than one thread uses the pool. The pool must be destroyed only
+   * after the other threads are done with it.
+   *
+   * BUDDY_HEADERLESS drops the in-band header from allocated blocks. The
+   * pointer returned is the block itself and its order is recovered from
+   * the pool's side table, so buddy_malloc(pool, 4096) takes exactly one
+   * 4096 byte block instead of an 8192 byte one.
+   *
+   * BUDDY_SLAB serves requests of up to SLAB_MAX_SIZE bytes from pages of
+   * the pool split into 8, 16 and 32 byte objects, instead of spending a
+   * whole 2^SMALLEST_K block on each. buddy_free recognizes these objects
+   * and returns a page to the pool once all of its objects are free.
+   *
+   * BUDDY_LAZY defers coalescing. A freed block is parked on a recently
+   * freed list for its order instead of merging with its buddies, and the
+   * next request of that order takes it back without splitting anything.
+   * Parked blocks are coalesced once an order holds more than its
+   * high-water mark of them or a request finds no free block large
+   * enough; buddy_coalesce does it on demand.
+   *
+   * BUDDY_GROWABLE lets the pool map another arena, up to BUDDY_MAX_ARENAS
+   * of them, instead of failing with ENOMEM once its own memory is used up.
+   * Each arena is a pool of its own with the same flags, buddy_free finds
+   * the arena a pointer belongs to through a hash of its address. Arenas
+   * that become completely free are unmapped again, except for one kept
+   * in reserve; a BUDDY_CONCURRENT pool keeps them until buddy_destroy
+   * since another thread may be inside one. Extra arenas are the size of
+   * the pool unless buddy_init_ex asks for another arena_size, and no
+   * single request can be larger than an arena or the pool.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param size The size of the pool in bytes.
+   * @param flags Bitwise or of BUDDY_* flags, 0 behaves like buddy_init
+   */
+  void buddy_init_flags(struct buddy_pool *pool, size_t size, unsigned int flags);
+
+  /**
+   * Initializes a pool like buddy_init_flags with control over how the pool
+   * is mapped. Every mapping option is best effort: when one cannot be
+   * honored the pool is still created without it, and opts->applied (as
+   * well as pool->map) tells which options took effect.
+   *
+   * BUDDY_MAP_HUGETLB maps the pool from the hugetlbfs pool. It needs a
+   * pool of at least 2^BUDDY_HUGE_K bytes and reserved huge pages; when it
+   * fails the pool is mapped normally and BUDDY_MAP_THP is tried instead.
+   * BUDDY_MAP_THP marks the pool with MADV_HUGEPAGE.
+   *
+   * BUDDY_MAP_POPULATE faults in every page of the pool and its side table
+   * before returning, BUDDY_MAP_PREFAULT does the same spread over
+   * prefault_threads threads. BUDDY_MAP_LOCKED locks the pool in RAM with
+   * mlock, which is limited by RLIMIT_MEMLOCK. Together these leave no
+   * page faults for later allocations to take.
+   *
+   * BUDDY_MAP_NORESERVE maps the pool with MAP_NORESERVE, so a pool far
+   * larger than RAM only costs the pages that are actually written. That
+   * suits simulating a large pool where nothing but the block headers is
+   * ever touched.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param opts The options, applied is filled in on return
+   */
+  void buddy_init_ex(struct buddy_pool *pool, struct buddy_init_opts *opts);
+
+  /**
+   * Turns on returning memory to the OS. Whenever a free block of order
+   * min_k or more has been sitting on its list for decay_ms, the body of
+   * the block past its first page is released with madvise. Blocks that
+   * are freed and reused within the decay time are never purged, so a hot
+   * block does not pay to be refaulted. Sweeps run from buddy_free when a
+   * large block is freed, at most twice per decay period, or on demand
+   * with buddy_purge. Passing min_k of 0 turns purging off again. The
+   * arenas of a BUDDY_GROWABLE pool follow the same settings, and
+   * buddy_purge and buddy_purge_stats cover all of them. Blocks purged
+   * under earlier settings count as resident again. Must not be called
+   * while other threads are using the pool; a publisher thread may go on
+   * reading the settings.
+   *
+   * @param pool The memory pool
+   * @param min_k The smallest order to purge, raised to one above the page order
+   * @param decay_ms How long a block has to stay free before it is purged
+   * @param advice MADV_FREE (the default, lazy) or MADV_DONTNEED (immediate)
+   */
+  void buddy_purge_config(struct buddy_pool *pool, size_t min_k, unsigned int decay_ms, int advice);
+
+  /**
+   * Runs a purge sweep now.
+   *
+   * @param pool The memory pool
+   * @param force Purge every eligible block regardless of how long it has been free
+   */
+  void buddy_purge(struct buddy_pool *pool, bool force);
+
+  /**
+   * Reports how much of the pool is resident and how much has been purged.
+   * Pages purged with MADV_FREE count as purged even though the kernel may
+   * not have reclaimed them yet.
+   *
+   * @param pool The memory pool
+   * @param out Receives the counters
+   */
+  void buddy_purge_stats(struct buddy_pool *pool, struct buddy_purge_stats *out);
+
+  /**
+   * Sets how many freed blocks of one order a BUDDY_LAZY pool parks
+   * before the oldest half of them is coalesced.
+   *
+   * @param pool The memory pool
+   * @param high_water Parked blocks per order, LAZY_DEFAULT_HIGH by default
+   */
+  void buddy_lazy_config(struct buddy_pool *pool, unsigned int high_water);
+
+  /**
+   * Coalesces every block a BUDDY_LAZY pool has parked, leaving the pool
+   * as an eager pool would be after the same frees.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_coalesce(struct buddy_pool *pool);
+
+  /**
+   * Reports how the pool is used without walking its memory. Every
+   * number comes from counters maintained by the allocation and free paths
+   * and the order bitmap, and covers the arenas of a BUDDY_GROWABLE pool
+   * too. In a concurrent pool the counters are read one at a time, so they
+   * may not add up exactly while other threads are working. With
+   * BUDDY_STATS set to 0 only largest_free_k is filled in and everything
+   * else reads 0.
+   *
+   * @param pool The memory pool
+   * @param out Receives the statistics
+   */
+  void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out);
+
+  /**
+   * Counts the extra arenas a BUDDY_GROWABLE pool has mapped.
+   *
+   * @param pool The memory pool
+   * @return The number of arenas besides the pool's own memory
+   */
+  size_t buddy_arena_count(struct buddy_pool *pool);
+
+  /**
+   * Tunes the per-thread caches of a BUDDY_THREAD_CACHE pool. Orders from
+   * SMALLEST_K up to max_k are cached. A thread keeps at most high_water
+   * blocks of each order; refills fetch high_water / 2 blocks at once and
+   * crossing the mark flushes back down to high_water / 2. Must be called
+   * before any thread allocates from the pool.
+   *
+   * @param pool The memory pool
+   * @param max_k The largest order to cache
+   * @param high_water The most blocks of one order a thread may hold
+   */
+  void buddy_thread_cache_config(struct buddy_pool *pool, size_t max_k, unsigned int high_water);
+
+  /**
+   * Returns every block held in the calling thread's cache to the pool.
+   * Threads flush automatically when they exit; this is for long lived
+   * threads that go idle.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_thread_cache_flush(struct buddy_pool *pool);
+
+  /**
+   * Starts recording every buddy_malloc, buddy_aligned_alloc, buddy_free
+   * and buddy_realloc on the pool to a trace file at path. Calls append a
+   * struct buddy_trace_record to an in-memory ring of ring_records
+   * entries and a background thread writes the ring out every few
+   * milliseconds, so recording costs a clock read and a few stores and
+   * never a system call. When the writer falls behind and the ring is full
+   * records are dropped and counted rather than stalling the caller. Must
+   * not be called while other threads are using the pool.
+   *
+   * @param pool The memory pool
+   * @param path The trace file to create or truncate
+   * @param ring_records Ring capacity, rounded up to a power of two, 0 for BUDDY_TRACE_DEFAULT_RECORDS
+   * @return 0 on success, an errno value otherwise
+   */
+  int buddy_trace_start(struct buddy_pool *pool, const char *path, size_t ring_records);
+
+  /**
+   * Stops recording, writes out what is still in the ring and closes the
+   * trace file. buddy_destroy does this for a pool that is still tracing.
+   * Must not be called while other threads are using the pool.
+   *
+   * @param pool The memory pool
+   * @return The number of records dropped because the ring was full
+   */
+  uint64_t buddy_trace_stop(struct buddy_pool *pool);
+
+  /**
+   * Starts timing every buddy_malloc, buddy_free and buddy_realloc on the
+   * pool. Each call reads the CPU cycle counter before and after and adds
+   * the difference to a histogram for its operation and the order of the
+   * block, along with how deep the split or coalesce cascade it caused
+   * went. Histograms are kept per thread so recording takes no lock or
+   * shared cache line; the histograms of a thread that exits, counts
+   * and all, are taken over by the next new thread. A slab object counts
+   * as order 0. Calls that fail are not timed, buddy_stats counts them.
+   * Must not be called while other threads are using the pool.
+   *
+   * @param pool The memory pool
+   * @return 0 on success, EBUSY if already started, ENOTSUP when built with BUDDY_LATENCY 0
+   */
+  int buddy_latency_start(struct buddy_pool *pool);
+
+  /**
+   * Stops timing and releases the histograms. buddy_destroy does this for
+   * a pool that is still timing. Must not be called while other threads
+   * are using the pool.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_latency_stop(struct buddy_pool *pool);
+
+  /**
+   * Adds up the histograms of every thread for one operation and order.
+   * Other threads may go on recording while this runs, so the result can
+   * be a few calls behind. Reads all zeros when the pool is not timing.
+   *
+   * @param pool The memory pool
+   * @param op A BUDDY_LAT_* operation
+   * @param k The order of the blocks, or BUDDY_LAT_ALL_ORDERS for all of them
+   * @param out Receives the histogram
+   */
+  void buddy_latency_read(struct buddy_pool *pool, int op, size_t k, struct buddy_latency *out);
+
+  /**
+   * Finds a percentile in a histogram from buddy_latency_read.
+   *
+   * @param h The histogram
+   * @param p The fraction of calls, 0.99 for p99
+   * @return The lower bound in cycles of the bucket the percentile falls in, 0 for an empty histogram
+   */
+  uint64_t buddy_latency_percentile(const struct buddy_latency *h, double p);
+
+  /**
+   * Rate of the cycle counter the histograms are kept in, measured once
+   * against CLOCK_MONOTONIC on first use. Where the CPU has no counter
+   * the user can read, latencies are kept in nanoseconds and this is 1.
+   *
+   * @return Counter ticks per nanosecond
+   */
+  double buddy_latency_cycles_per_ns(void);
+
+  /**
+   * Starts publishing the pool's counters to a POSIX shared memory page
+   * another process can read without stopping this one, as buddytop does.
+   * A background thread takes a buddy_stats and buddy_purge_stats snapshot
+   * every interval_ms and copies it into the page under a sequence count,
+   * so the allocation paths do nothing more than keep their counters and
+   * neither side ever waits on the other. A BUDDY_GROWABLE pool keeps
+   * every arena it maps until publishing stops. Must not be called while
+   * other threads are using the pool.
+   *
+   * @param pool The memory pool
+   * @param name Shared memory name starting with '/', NULL for BUDDY_SHM_PREFIX and the pid
+   * @param interval_ms Time between snapshots, 0 for BUDDY_SHM_DEFAULT_MS
+   * @return 0 on success, an errno value otherwise
+   */
+  int buddy_publish_start(struct buddy_pool *pool, const char *name, unsigned int interval_ms);
+
+  /**
+   * Stops publishing and removes the shared memory page. buddy_destroy
+   * does this for a pool that is still publishing. Must not be called
+   * while other threads are using the pool.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_publish_stop(struct buddy_pool *pool);
+
+  /**
+   * Starts sampling allocations to find out which call sites hold the
+   * pool's memory. Every thread counts down the bytes it requests from
+   * buddy_malloc, buddy_aligned_alloc, buddy_malloc_batch and
+   * buddy_realloc, and the allocation that takes the count below zero is
+   * sampled: its call stack is taken by walking frame pointers and kept
+   * with its size until the block is freed. The gaps between samples are
+   * drawn from an exponential distribution averaging interval bytes, so
+   * a large allocation is more likely to be sampled and the profile can
+   * be scaled back up to the whole heap. Frees check a small table of
+   * counters before looking for a sample, so most of them pay one load.
+   * Callers need to be built with -fno-omit-frame-pointer for the stacks
+   * to be complete. Must not be called while other threads are using the
+   * pool.
+   *
+   * @param pool The memory pool
+   * @param interval Mean bytes between samples, 0 for BUDDY_HEAP_DEFAULT_INTERVAL
+   * @return 0 on success, EBUSY if already started, ENOMEM
+   */
+  int buddy_heap_profile_start(struct buddy_pool *pool, size_t interval);
+
+  /**
+   * Writes the sampled allocations to path as a legacy gperftools heap
+   * profile (heap_v2), which pprof reads: in-use and total sampled
+   * objects and bytes per call stack, followed by the process's memory
+   * map so the addresses can be symbolized. Sizes are the bytes
+   * requested, not the blocks that served them. May be called while other
+   * threads use the pool.
+   *
+   * @param pool The memory pool
+   * @param path The file to create or truncate
+   * @return 0 on success, EINVAL if the pool is not profiling, an errno value otherwise
+   */
+  int buddy_heap_profile_dump(struct buddy_pool *pool, const char *path);
+
+  /**
+   * Stops sampling and drops every sample. buddy_destroy does this for a
+   * pool that is still profiling. Must not be called while other threads
+   * are using the pool.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_heap_profile_stop(struct buddy_pool *pool);
+
   /**
    * Inverse of buddy_init.
    *
@@ -163,7 +910,8 @@ extern "C"
   void buddy_destroy(struct buddy_pool *pool);
 
   /**
-   * @brief Entry to a main function for testing purposes
+   * @brief Entry point of the trace replay driver in app/main.c, which
+   * replays a buddy_trace_start trace against a pool and glibc malloc
    *
    * @param argc system argc
    * @param argv system argv
@@ -1,6 +1,11 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -50,6 +55,66 @@ void check_buddy_pool_empty(struct buddy_pool *pool)
     }
 }
 
+void check_avail_bits(struct buddy_pool *pool)
+{
+    //Bit k of the order bitmap must be set exactly when avail[k] is non-empty
+    for (size_t i = 0; i < MAX_K; i++)
+    {
+        bool nonempty = pool->avail[i].next != &pool->avail[i];
+        bool bit = (pool->avail_bits >> i) & 1;
+        assert(nonempty == bit);
+    }
+}
+
+void check_meta(struct buddy_pool *pool)
+{
+    //Every block on a free list must be recorded as AVAIL at its order
+    for (size_t i = 0; i <= pool->kval_m; i++)
+    {
+        for (struct avail *b = pool->avail[i].next; b != &pool->avail[i]; b = b->next)
+        {
+            size_t slot = ((uintptr_t)b - (uintptr_t)pool->base) >> SMALLEST_K;
+            assert(pool->meta[slot] == BLOCK_META(BLOCK_AVAIL, i));
+        }
+    }
+}
+
+size_t pool_free_bytes(struct buddy_pool *pool)
+{
+    size_t total = 0;
+    for (size_t i = 0; i <= pool->kval_m; i++)
+    {
+        for (struct avail *b = pool->avail[i].next; b != &pool->avail[i]; b = b->next)
+        {
+            total += UINT64_C(1) << i;
+        }
+    }
+    return total;
+}
+
+void check_stats(struct buddy_pool *pool)
+{
+#if BUDDY_STATS
+    //The per-order free counters must match the lists and account for
+    //every byte that is not reserved
+    size_t free_bytes = 0;
+    for (size_t i = 0; i <= pool->kval_m; i++)
+    {
+        size_t n = 0;
+        for (struct avail *b = pool->avail[i].next; b != &pool->avail[i]; b = b->next)
+        {
+            n++;
+        }
+        assert(pool->stats.free_blocks[i] == n);
+        free_bytes += n << i;
+    }
+    assert(pool->stats.alloc_bytes == pool->numbytes - free_bytes);
+    assert(pool->stats.peak_bytes >= pool->stats.alloc_bytes);
+#else
+    (void)pool;
+#endif
+}
+
 // Original test functions
 void test_buddy_init(void)
 {
@@ -128,6 +193,48 @@ void test_btok_edge_cases(void) {
     TEST_ASSERT_EQUAL(MAX_K - 1, btok(max_size));
 }
 
+//Reference implementation of btok, kept to check the clz version against
+static size_t btok_loop(size_t bytes)
+{
+    size_t k = SMALLEST_K;
+    while ((UINT64_C(1) << k) < bytes && k < MAX_K)
+    {
+        k++;
+    }
+    return k;
+}
+
+void test_btok_matches_loop(void) {
+    fprintf(stderr, "->Testing btok against the shift loop\n");
+    size_t sizes[512];
+    size_t n = 0;
+
+    //Every power of two and its neighbours, plus the zero and SIZE_MAX edges
+    sizes[n++] = 0;
+    sizes[n++] = SIZE_MAX;
+    for (size_t k = 0; k < 64; k++)
+    {
+        size_t p = (size_t)1 << k;
+        sizes[n++] = p - 1;
+        sizes[n++] = p;
+        sizes[n++] = p + 1;
+    }
+    while (n < sizeof(sizes) / sizeof(sizes[0]))
+    {
+        sizes[n++] = ((size_t)rand() << 31) ^ (size_t)rand();
+    }
+
+    size_t kvals[sizeof(sizes) / sizeof(sizes[0])];
+    btok_batch(sizes, kvals, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT64(btok_loop(sizes[i]), btok(sizes[i]));
+        TEST_ASSERT_EQUAL_UINT64(btok(sizes[i]), kvals[i]);
+    }
+    TEST_ASSERT_EQUAL(SMALLEST_K, btok(0));
+    TEST_ASSERT_EQUAL(MAX_K, btok(SIZE_MAX));
+}
+
 void test_buddy_calc_edge_cases(void) {
     fprintf(stderr, "->Testing buddy_calc edge cases\n");
     struct buddy_pool pool;
@@ -435,6 +542,1400 @@ void test_realloc_content(void) {
     buddy_destroy(&pool);
 }
 
+void test_avail_bits(void) {
+    fprintf(stderr, "->Testing order bitmap tracks the avail lists\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    TEST_ASSERT_EQUAL_UINT64(UINT64_C(1) << MIN_K, pool.avail_bits);
+
+    //Splitting down to SMALLEST_K leaves one free block at every order below MIN_K
+    void *small = buddy_malloc(&pool, 1);
+    TEST_ASSERT_NOT_NULL(small);
+    check_avail_bits(&pool);
+    TEST_ASSERT_EQUAL_UINT64(((UINT64_C(1) << MIN_K) - 1) & ~((UINT64_C(1) << SMALLEST_K) - 1),
+                             pool.avail_bits);
+
+    //Scatter a mix of sizes and free them out of order
+    void *ptrs[32];
+    for (int i = 0; i < 32; i++) {
+        ptrs[i] = buddy_malloc(&pool, (size_t)(rand() % 4096) + 1);
+        TEST_ASSERT_NOT_NULL(ptrs[i]);
+        check_avail_bits(&pool);
+    }
+    for (int i = 0; i < 32; i += 2) {
+        buddy_free(&pool, ptrs[i]);
+        check_avail_bits(&pool);
+    }
+    for (int i = 1; i < 32; i += 2) {
+        buddy_free(&pool, ptrs[i]);
+        check_avail_bits(&pool);
+    }
+
+    buddy_free(&pool, small);
+    check_avail_bits(&pool);
+    check_buddy_pool_full(&pool);
+    TEST_ASSERT_EQUAL_UINT64(UINT64_C(1) << MIN_K, pool.avail_bits);
+    buddy_destroy(&pool);
+}
+
+#define STRESS_THREADS 4
+#define STRESS_SLOTS 64
+#define STRESS_ROUNDS 20000
+
+struct stress_arg
+{
+    struct buddy_pool *pool;
+    unsigned seed;
+    unsigned char tag;
+    int failures;
+};
+
+static void *stress_worker(void *arg)
+{
+    struct stress_arg *sa = arg;
+    unsigned char *slots[STRESS_SLOTS] = {0};
+    size_t sizes[STRESS_SLOTS] = {0};
+
+    for (int i = 0; i < STRESS_ROUNDS; i++)
+    {
+        int s = rand_r(&sa->seed) % STRESS_SLOTS;
+        if (slots[s])
+        {
+            //Every byte must still carry the pattern this thread wrote
+            for (size_t b = 0; b < sizes[s]; b++)
+            {
+                if (slots[s][b] != (unsigned char)(s + sa->tag))
+                {
+                    sa->failures++;
+                    break;
+                }
+            }
+            //Now and then resize instead, growing or shrinking in place
+            //where the pool allows it
+            if (rand_r(&sa->seed) % 4 == 0)
+            {
+                size_t size = (size_t)(rand_r(&sa->seed) % 4096) + 1;
+                unsigned char *p = buddy_realloc(sa->pool, slots[s], size);
+                if (!p)
+                {
+                    sa->failures++;
+                    continue;
+                }
+                memset(p, (unsigned char)(s + sa->tag), size);
+                slots[s] = p;
+                sizes[s] = size;
+                continue;
+            }
+            buddy_free(sa->pool, slots[s]);
+            slots[s] = NULL;
+        }
+        else
+        {
+            //Half tiny objects, half anything up to 2 KiB
+            size_t max = (rand_r(&sa->seed) & 1) ? 48 : 2048;
+            sizes[s] = (size_t)(rand_r(&sa->seed) % max) + 1;
+            slots[s] = buddy_malloc(sa->pool, sizes[s]);
+            if (!slots[s])
+            {
+                sa->failures++;
+                continue;
+            }
+            memset(slots[s], (unsigned char)(s + sa->tag), sizes[s]);
+        }
+    }
+    //Whatever is left goes back in one batch
+    void *left[STRESS_SLOTS];
+    for (int s = 0; s < STRESS_SLOTS; s++)
+    {
+        left[s] = slots[s];
+    }
+    buddy_free_batch(sa->pool, left, STRESS_SLOTS);
+    return NULL;
+}
+
+static void run_stress(unsigned int flags, size_t kval)
+{
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << kval, flags);
+    TEST_ASSERT_NOT_NULL(pool.base);
+
+    pthread_t threads[STRESS_THREADS];
+    struct stress_arg args[STRESS_THREADS];
+    for (int t = 0; t < STRESS_THREADS; t++)
+    {
+        args[t].pool = &pool;
+        args[t].seed = (unsigned)rand();
+        args[t].tag = (unsigned char)(t * STRESS_SLOTS);
+        args[t].failures = 0;
+        pthread_create(&threads[t], NULL, stress_worker, &args[t]);
+    }
+    for (int t = 0; t < STRESS_THREADS; t++)
+    {
+        pthread_join(threads[t], NULL);
+        TEST_ASSERT_EQUAL(0, args[t].failures);
+    }
+
+    //Everything was freed (and thread caches flushed on exit) so the pool
+    //must have coalesced back to one block, once parked blocks are merged
+    buddy_coalesce(&pool);
+    check_avail_bits(&pool);
+    check_meta(&pool);
+    check_stats(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_concurrent_stress(void) {
+    fprintf(stderr, "->Testing concurrent malloc/free from %d threads\n", STRESS_THREADS);
+    run_stress(BUDDY_CONCURRENT, 24);
+}
+
+void test_slab_stress(void) {
+    fprintf(stderr, "->Testing slabs and thread caches from %d threads\n", STRESS_THREADS);
+    run_stress(BUDDY_CONCURRENT | BUDDY_THREAD_CACHE | BUDDY_SLAB, 24);
+}
+
+void test_thread_cache_stress(void) {
+    fprintf(stderr, "->Testing thread caches from %d threads\n", STRESS_THREADS);
+    run_stress(BUDDY_CONCURRENT | BUDDY_THREAD_CACHE, 24);
+}
+
+void test_growable_stress(void) {
+    fprintf(stderr, "->Testing a growable pool from %d threads\n", STRESS_THREADS);
+    //A 256 KiB pool cannot hold the workload, so the threads keep mapping
+    //and sharing new arenas
+    run_stress(BUDDY_CONCURRENT | BUDDY_THREAD_CACHE | BUDDY_SLAB | BUDDY_GROWABLE, 18);
+}
+
+void test_lazy_stress(void) {
+    fprintf(stderr, "->Testing lazy coalescing from %d threads\n", STRESS_THREADS);
+    run_stress(BUDDY_CONCURRENT | BUDDY_LAZY, 24);
+    run_stress(BUDDY_CONCURRENT | BUDDY_THREAD_CACHE | BUDDY_SLAB | BUDDY_LAZY, 24);
+}
+
+void test_thread_cache(void) {
+    fprintf(stderr, "->Testing thread cache refill, high-water mark and flush\n");
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_THREAD_CACHE);
+    buddy_thread_cache_config(&pool, 10, 8);
+
+    //The first allocation refills the cache with high_water / 2 blocks
+    void *ptrs[16];
+    ptrs[0] = buddy_malloc(&pool, 1);
+    TEST_ASSERT_NOT_NULL(ptrs[0]);
+    for (int i = 1; i < 16; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, 1);
+        TEST_ASSERT_NOT_NULL(ptrs[i]);
+    }
+
+    //Freeing everything must not leave more than high_water blocks cached,
+    //so the pool gets the rest back straight away
+    for (int i = 0; i < 16; i++)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    size_t held = (UINT64_C(1) << MIN_K) - pool_free_bytes(&pool);
+    TEST_ASSERT_TRUE(held <= 8 * (UINT64_C(1) << SMALLEST_K));
+
+    //Orders above the cap bypass the cache entirely
+    void *big = buddy_malloc(&pool, 4096);
+    TEST_ASSERT_NOT_NULL(big);
+    buddy_free(&pool, big);
+
+    buddy_thread_cache_flush(&pool);
+    check_avail_bits(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_meta_side_table(void) {
+    fprintf(stderr, "->Testing merges are decided from the side table\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_AVAIL, MIN_K), pool.meta[0]);
+
+    //Two sibling blocks of the smallest order
+    void *a = buddy_malloc(&pool, 1);
+    void *b = buddy_malloc(&pool, 1);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    struct avail *ba = (struct avail *)a - 1;
+    struct avail *bb = (struct avail *)b - 1;
+    TEST_ASSERT_EQUAL_PTR(bb, buddy_calc(&pool, ba));
+    size_t slot_b = ((uintptr_t)bb - (uintptr_t)pool.base) >> SMALLEST_K;
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_RESERVED, SMALLEST_K), pool.meta[slot_b]);
+
+    //Scribble over the in-band tag and kval of the free buddy, freeing its
+    //sibling must still merge because only the side table is consulted
+    buddy_free(&pool, b);
+    check_meta(&pool);
+    bb->tag = BLOCK_RESERVED;
+    bb->kval = 0;
+    buddy_free(&pool, a);
+
+    //The upper half of every merge stops being a block start
+    TEST_ASSERT_EQUAL_UINT8(0, pool.meta[slot_b]);
+    check_meta(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_headerless(void) {
+    fprintf(stderr, "->Testing headerless allocations\n");
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_HEADERLESS);
+
+    //A power of two request takes exactly one block of that order, and the
+    //pointer is the block itself so it is aligned to the block size
+    char *page = buddy_malloc(&pool, 4096);
+    TEST_ASSERT_NOT_NULL(page);
+    size_t slot = ((uintptr_t)page - (uintptr_t)pool.base) >> SMALLEST_K;
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_RESERVED, 12), pool.meta[slot]);
+    TEST_ASSERT_EQUAL(0, ((uintptr_t)page - (uintptr_t)pool.base) % 4096);
+
+    char *small = buddy_malloc(&pool, 64);
+    TEST_ASSERT_NOT_NULL(small);
+    slot = ((uintptr_t)small - (uintptr_t)pool.base) >> SMALLEST_K;
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_RESERVED, SMALLEST_K), pool.meta[slot]);
+
+    //Realloc keeps the whole block usable and preserves content when moving
+    memset(small, 0x5a, 64);
+    TEST_ASSERT_EQUAL_PTR(small, buddy_realloc(&pool, small, 64));
+    char *grown = buddy_realloc(&pool, small, 100);
+    TEST_ASSERT_NOT_NULL(grown);
+    for (int i = 0; i < 64; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x5a, grown[i]);
+    }
+
+    buddy_free(&pool, grown);
+    buddy_free(&pool, page);
+    check_meta(&pool);
+    check_buddy_pool_full(&pool);
+
+    //The whole pool can be handed out as one allocation
+    void *all = buddy_malloc(&pool, UINT64_C(1) << MIN_K);
+    TEST_ASSERT_EQUAL_PTR(pool.base, all);
+    check_buddy_pool_empty(&pool);
+    buddy_free(&pool, all);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_slab(void) {
+    fprintf(stderr, "->Testing slab allocations for tiny objects\n");
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_SLAB);
+
+    //Fill several pages worth of each size class
+    size_t sizes[] = {1, 8, 9, 16, 17, 32};
+    enum { PER_SIZE = 600 };
+    static unsigned char *objs[6][PER_SIZE];
+    for (size_t s = 0; s < 6; s++)
+    {
+        for (size_t i = 0; i < PER_SIZE; i++)
+        {
+            objs[s][i] = buddy_malloc(&pool, sizes[s]);
+            TEST_ASSERT_NOT_NULL(objs[s][i]);
+            memset(objs[s][i], (int)(s * 31 + i), sizes[s]);
+        }
+    }
+
+    //Objects are aligned to their class and live on pages marked as slabs
+    for (size_t s = 0; s < 6; s++)
+    {
+        size_t cls = sizes[s] <= 8 ? 8 : sizes[s] <= 16 ? 16 : 32;
+        for (size_t i = 0; i < PER_SIZE; i++)
+        {
+            uintptr_t offset = (uintptr_t)objs[s][i] - (uintptr_t)pool.base;
+            TEST_ASSERT_EQUAL(0, offset % cls);
+            size_t page = (offset >> SLAB_K) << (SLAB_K - SMALLEST_K);
+            TEST_ASSERT_EQUAL(BLOCK_SLAB, BLOCK_META_STATE(pool.meta[page]));
+            for (size_t b = 0; b < sizes[s]; b++)
+            {
+                TEST_ASSERT_EQUAL_HEX8((unsigned char)(s * 31 + i), objs[s][i][b]);
+            }
+        }
+    }
+
+    //Larger requests still come straight from the buddy lists
+    void *big = buddy_malloc(&pool, 33);
+    TEST_ASSERT_NOT_NULL(big);
+    struct avail *block = (struct avail *)big - 1;
+    size_t slot = ((uintptr_t)block - (uintptr_t)pool.base) >> SMALLEST_K;
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_RESERVED, SMALLEST_K), pool.meta[slot]);
+    buddy_free(&pool, big);
+
+    //Growing a slab object past its class moves it out of the slab
+    unsigned char *moved = buddy_realloc(&pool, objs[0][0], 100);
+    TEST_ASSERT_NOT_NULL(moved);
+    TEST_ASSERT_EQUAL_HEX8(0, moved[0]);
+    objs[0][0] = moved;
+
+    //Once every object is gone the pages return and the pool coalesces
+    for (size_t s = 0; s < 6; s++)
+    {
+        for (size_t i = 0; i < PER_SIZE; i++)
+        {
+            buddy_free(&pool, objs[s][i]);
+        }
+    }
+    check_meta(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_aligned_alloc(void) {
+    fprintf(stderr, "->Testing aligned allocations\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+    //Every alignment up to a page, with sizes below, at and above it
+    for (size_t align = 16; align <= 4096; align <<= 1)
+    {
+        size_t sizes[] = {1, align / 2, align, align + 1};
+        for (int i = 0; i < 4; i++)
+        {
+            char *p = buddy_aligned_alloc(&pool, align, sizes[i]);
+            TEST_ASSERT_NOT_NULL(p);
+            TEST_ASSERT_EQUAL(0, (uintptr_t)p % align);
+
+            //No header, so the block is no bigger than size or alignment needs
+            size_t want = btok(sizes[i]) > btok(align) ? btok(sizes[i]) : btok(align);
+            size_t slot = ((uintptr_t)p - (uintptr_t)pool.base) >> SMALLEST_K;
+            TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_RESERVED, want), pool.meta[slot]);
+            memset(p, 0xa5, sizes[i]);
+            buddy_free(&pool, p);
+        }
+    }
+    check_buddy_pool_full(&pool);
+
+    //posix_memalign reports errors through its return value
+    void *mem = NULL;
+    TEST_ASSERT_EQUAL(0, buddy_posix_memalign(&pool, &mem, 64, 4096));
+    TEST_ASSERT_NOT_NULL(mem);
+    TEST_ASSERT_EQUAL(0, (uintptr_t)mem % 64);
+    void *keep = mem;
+    TEST_ASSERT_EQUAL(EINVAL, buddy_posix_memalign(&pool, &mem, 4, 16));
+    TEST_ASSERT_EQUAL(EINVAL, buddy_posix_memalign(&pool, &mem, 48, 16));
+    TEST_ASSERT_EQUAL(ENOMEM, buddy_posix_memalign(&pool, &mem, 64, UINT64_C(1) << (MIN_K + 1)));
+    TEST_ASSERT_EQUAL_PTR(keep, mem);
+    TEST_ASSERT_NULL(buddy_aligned_alloc(&pool, 24, 16));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+
+    //Small alignments fall back to the ordinary headered path
+    void *plain = buddy_aligned_alloc(&pool, 8, 100);
+    TEST_ASSERT_NOT_NULL(plain);
+    buddy_free(&pool, plain);
+    buddy_free(&pool, mem);
+    check_meta(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_base_alignment(void) {
+    fprintf(stderr, "->Testing the pool base is aligned to the pool size\n");
+    for (size_t i = MIN_K; i <= DEFAULT_K; i++)
+    {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << i);
+        TEST_ASSERT_NOT_NULL(pool.base);
+        TEST_ASSERT_EQUAL(0, (uintptr_t)pool.base % (UINT64_C(1) << i));
+
+        //So a block of any order is aligned to its size in memory
+        void *half = buddy_aligned_alloc(&pool, UINT64_C(1) << (i - 1), 1);
+        TEST_ASSERT_NOT_NULL(half);
+        TEST_ASSERT_EQUAL(0, (uintptr_t)half % (UINT64_C(1) << (i - 1)));
+        void *small = buddy_malloc(&pool, 3000);
+        struct avail *block = (struct avail *)small - 1;
+        TEST_ASSERT_EQUAL(0, (uintptr_t)block % 4096);
+        buddy_free(&pool, small);
+        buddy_free(&pool, half);
+        check_buddy_pool_full(&pool);
+        buddy_destroy(&pool);
+    }
+}
+
+void test_realloc_in_place(void) {
+    fprintf(stderr, "->Testing in-place realloc growth and shrink\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+    //The first block of a fresh pool has every upper buddy free, so it can
+    //grow all the way without moving
+    char *p = buddy_malloc(&pool, 100);
+    TEST_ASSERT_EQUAL_PTR((char *)pool.base + sizeof(struct avail), p);
+    memset(p, 0x11, 100);
+    char *grown = buddy_realloc(&pool, p, 100000);
+    TEST_ASSERT_EQUAL_PTR(p, grown);
+    TEST_ASSERT_EQUAL(17, ((struct avail *)p - 1)->kval);
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_RESERVED, 17), pool.meta[0]);
+    for (int i = 0; i < 100; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x11, grown[i]);
+    }
+    check_meta(&pool);
+    check_avail_bits(&pool);
+
+    //Shrinking releases the trailing halves straight away
+    size_t before = pool_free_bytes(&pool);
+    char *shrunk = buddy_realloc(&pool, grown, 40);
+    TEST_ASSERT_EQUAL_PTR(p, shrunk);
+    TEST_ASSERT_EQUAL(SMALLEST_K, ((struct avail *)p - 1)->kval);
+    TEST_ASSERT_EQUAL(before + (UINT64_C(1) << 17) - (UINT64_C(1) << SMALLEST_K),
+                      pool_free_bytes(&pool));
+    for (int i = 0; i < 40; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x11, shrunk[i]);
+    }
+    check_meta(&pool);
+
+    //With the upper buddy taken the block has to move
+    char *neighbour = buddy_malloc(&pool, 1);
+    TEST_ASSERT_EQUAL_PTR((char *)pool.base + 64 + sizeof(struct avail), neighbour);
+    char *moved = buddy_realloc(&pool, shrunk, 200);
+    TEST_ASSERT_NOT_NULL(moved);
+    TEST_ASSERT_TRUE(moved != shrunk);
+    for (int i = 0; i < 40; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x11, moved[i]);
+    }
+
+    //Headerless blocks grow and shrink without their data being disturbed
+    buddy_free(&pool, moved);
+    buddy_free(&pool, neighbour);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_HEADERLESS);
+    p = buddy_malloc(&pool, 64);
+    memset(p, 0x22, 64);
+    TEST_ASSERT_EQUAL_PTR(p, buddy_realloc(&pool, p, 4096));
+    TEST_ASSERT_EQUAL_PTR(p, buddy_realloc(&pool, p, 64));
+    for (int i = 0; i < 64; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x22, p[i]);
+    }
+    buddy_free(&pool, p);
+    check_meta(&pool);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_purge(void) {
+    fprintf(stderr, "->Testing purging free blocks back to the OS\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    //Orders at or below the page order have nothing past their first page
+    buddy_purge_config(&pool, 1, 60000, MADV_DONTNEED);
+    TEST_ASSERT_TRUE((UINT64_C(1) << pool.purge_k) > page);
+
+    //Inside the decay window a normal sweep leaves young blocks alone
+    char *p = buddy_malloc(&pool, 100000);
+    memset(p, 0x5a, 100000);
+    buddy_free(&pool, p);
+    struct buddy_purge_stats stats;
+    buddy_purge(&pool, false);
+    buddy_purge_stats(&pool, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.purged_bytes);
+    TEST_ASSERT_EQUAL_UINT64(pool.numbytes, stats.resident_bytes);
+
+    //A forced sweep purges the whole free pool but its first page
+    buddy_purge(&pool, true);
+    buddy_purge_stats(&pool, &stats);
+    TEST_ASSERT_EQUAL_UINT64(pool.numbytes - page, stats.purged_bytes);
+    TEST_ASSERT_EQUAL_UINT64(stats.purged_bytes, stats.purged_total);
+    TEST_ASSERT_EQUAL_UINT64(page, stats.resident_bytes);
+
+    //MADV_DONTNEED hands back zero pages, and reuse makes them resident again
+    p = buddy_malloc(&pool, 100000);
+    TEST_ASSERT_EQUAL_HEX8(0, p[page]);
+    TEST_ASSERT_EQUAL_HEX8(0x5a, p[100]);
+    buddy_purge_stats(&pool, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.purged_bytes);
+    check_meta(&pool);
+    buddy_free(&pool, p);
+
+    //With no decay every large free sweeps straight away
+    buddy_purge_config(&pool, 17, 0, MADV_FREE);
+    p = buddy_malloc(&pool, 100000);
+    buddy_free(&pool, p);
+    buddy_purge_stats(&pool, &stats);
+    TEST_ASSERT_EQUAL_UINT64(pool.numbytes - page, stats.purged_bytes);
+
+    //Turning purging off stops the sweeps
+    buddy_purge_config(&pool, 0, 0, MADV_FREE);
+    p = buddy_malloc(&pool, 100000);
+    buddy_free(&pool, p);
+    buddy_purge_stats(&pool, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.purged_bytes);
+
+    //New settings start the count over, and blocks purged under the old
+    //ones no longer come off it when they are reused
+    buddy_purge_config(&pool, 17, 60000, MADV_FREE);
+    buddy_purge(&pool, true);
+    buddy_purge_config(&pool, 19, 60000, MADV_FREE);
+    buddy_purge_stats(&pool, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.purged_bytes);
+    p = buddy_malloc(&pool, 100000);
+    buddy_purge_stats(&pool, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.purged_bytes);
+    buddy_free(&pool, p);
+    buddy_purge_config(&pool, 0, 0, MADV_FREE);
+
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_init_ex(void) {
+    fprintf(stderr, "->Testing buddy_init_ex mapping options\n");
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t npages = (UINT64_C(1) << MIN_K) / page;
+    unsigned char *vec = malloc(npages);
+    int modes[] = { BUDDY_MAP_POPULATE, BUDDY_MAP_PREFAULT };
+
+    for (int m = 0; m < 2; m++) {
+        //Faulting the pool in up front leaves every page resident
+        struct buddy_pool pool;
+        struct buddy_init_opts opts = {
+            .size = UINT64_C(1) << MIN_K,
+            .map = modes[m] | BUDDY_MAP_THP | BUDDY_MAP_LOCKED,
+            .prefault_threads = 3,
+        };
+        buddy_init_ex(&pool, &opts);
+        TEST_ASSERT_NOT_NULL(pool.base);
+        TEST_ASSERT_EQUAL_UINT(opts.applied, pool.map);
+        TEST_ASSERT_EQUAL_UINT(0, opts.applied & ~opts.map);
+        TEST_ASSERT_TRUE(opts.applied & modes[m]);
+        TEST_ASSERT_EQUAL(0, mincore(pool.base, pool.numbytes, vec));
+        for (size_t i = 0; i < npages; i++)
+        {
+            TEST_ASSERT_EQUAL_UINT8(1, vec[i] & 1);
+        }
+        check_buddy_pool_full(&pool);
+        buddy_destroy(&pool);
+    }
+
+    //A pool smaller than a huge page cannot use hugetlb and falls back
+    struct buddy_pool pool;
+    struct buddy_init_opts opts = { .size = UINT64_C(1) << MIN_K, .map = BUDDY_MAP_HUGETLB };
+    buddy_init_ex(&pool, &opts);
+    TEST_ASSERT_NOT_NULL(pool.base);
+    TEST_ASSERT_EQUAL_UINT(0, opts.applied & BUDDY_MAP_HUGETLB);
+    void *p = buddy_malloc(&pool, 1000);
+    TEST_ASSERT_NOT_NULL(p);
+    buddy_free(&pool, p);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+
+    //Huge pages are usually not reserved, either way the pool has to work
+    opts.size = UINT64_C(1) << BUDDY_HUGE_K;
+    buddy_init_ex(&pool, &opts);
+    TEST_ASSERT_NOT_NULL(pool.base);
+    p = buddy_malloc(&pool, 1000);
+    TEST_ASSERT_NOT_NULL(p);
+    memset(p, 0xab, 1000);
+    buddy_free(&pool, p);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+    free(vec);
+}
+
+void test_growable(void) {
+    fprintf(stderr, "->Testing a pool that grows extra arenas\n");
+    struct buddy_pool pool;
+    struct buddy_init_opts opts = { .size = UINT64_C(1) << MIN_K, .flags = BUDDY_GROWABLE };
+    buddy_init_ex(&pool, &opts);
+    TEST_ASSERT_NOT_NULL(pool.base);
+    TEST_ASSERT_EQUAL(MIN_K, pool.arena_k);
+    TEST_ASSERT_EQUAL(0, buddy_arena_count(&pool));
+
+    //Two half-pool blocks fit in each arena, so eight of them need three
+    //arenas besides the pool
+    size_t half = (UINT64_C(1) << (MIN_K - 1)) - sizeof(struct avail);
+    char *ptrs[8];
+    for (int i = 0; i < 8; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, half);
+        TEST_ASSERT_NOT_NULL(ptrs[i]);
+        memset(ptrs[i], i + 1, half);
+    }
+    TEST_ASSERT_EQUAL(3, buddy_arena_count(&pool));
+    check_buddy_pool_empty(&pool);
+
+    //Nothing larger than an arena can be served
+    errno = 0;
+    TEST_ASSERT_NULL(buddy_malloc(&pool, UINT64_C(1) << MIN_K));
+    TEST_ASSERT_EQUAL(ENOMEM, errno);
+
+    //A block that cannot grow where it is moves to a new arena, the hole
+    //left in another arena is too small for it
+    buddy_free(&pool, ptrs[2]);
+    char *moved = buddy_realloc(&pool, ptrs[0], half + 100);
+    TEST_ASSERT_NOT_NULL(moved);
+    TEST_ASSERT_TRUE(moved != ptrs[0]);
+    TEST_ASSERT_EQUAL(4, buddy_arena_count(&pool));
+    for (size_t j = 0; j < half; j++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(1, moved[j]);
+    }
+    ptrs[0] = moved;
+    ptrs[2] = NULL;
+
+    //Every byte landed where it was written
+    for (int i = 3; i < 8; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(i + 1, ptrs[i][0]);
+        TEST_ASSERT_EQUAL_HEX8(i + 1, ptrs[i][half - 1]);
+    }
+
+    //Arenas that empty out are unmapped, all but one spare
+    for (int i = 0; i < 8; i++)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    TEST_ASSERT_EQUAL(1, buddy_arena_count(&pool));
+    check_buddy_pool_full(&pool);
+
+    //The spare is reused before anything new is mapped
+    ptrs[0] = buddy_malloc(&pool, half + 100);
+    TEST_ASSERT_NOT_NULL(ptrs[0]);
+    TEST_ASSERT_EQUAL(1, buddy_arena_count(&pool));
+    buddy_free(&pool, ptrs[0]);
+    buddy_destroy(&pool);
+}
+
+void test_growable_oversized(void) {
+    fprintf(stderr, "->Testing requests no arena can serve leave the arenas alone\n");
+    unsigned flags[] = { BUDDY_GROWABLE, BUDDY_GROWABLE | BUDDY_CONCURRENT };
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++)
+    {
+        struct buddy_pool pool;
+        struct buddy_init_opts opts = { .size = UINT64_C(1) << MIN_K, .flags = flags[f] };
+        buddy_init_ex(&pool, &opts);
+        TEST_ASSERT_NOT_NULL(pool.base);
+
+        //Fill the pool so every request below has to look at the arenas
+        void *full = buddy_malloc(&pool, (UINT64_C(1) << MIN_K) - sizeof(struct avail));
+        TEST_ASSERT_NOT_NULL(full);
+        size_t before = buddy_arena_count(&pool);
+
+        void *out[4];
+        size_t big = UINT64_C(1) << (MIN_K + 1);
+        for (int i = 0; i < 70; i++)
+        {
+            errno = 0;
+            TEST_ASSERT_NULL(buddy_malloc(&pool, big));
+            TEST_ASSERT_EQUAL(ENOMEM, errno);
+            errno = 0;
+            TEST_ASSERT_NULL(buddy_aligned_alloc(&pool, 4096, big));
+            TEST_ASSERT_EQUAL(ENOMEM, errno);
+            TEST_ASSERT_EQUAL(0, buddy_malloc_batch(&pool, big, 4, out));
+        }
+        //Just too big once the header is added
+        errno = 0;
+        TEST_ASSERT_NULL(buddy_malloc(&pool, UINT64_C(1) << MIN_K));
+        TEST_ASSERT_EQUAL(ENOMEM, errno);
+        TEST_ASSERT_EQUAL(before, buddy_arena_count(&pool));
+
+        buddy_free(&pool, full);
+        buddy_destroy(&pool);
+    }
+}
+
+void test_growable_peak(void) {
+    fprintf(stderr, "->Testing the peak of a pool with arenas\n");
+    struct buddy_pool pool;
+    struct buddy_init_opts opts = { .size = UINT64_C(1) << MIN_K, .flags = BUDDY_GROWABLE };
+    buddy_init_ex(&pool, &opts);
+    TEST_ASSERT_NOT_NULL(pool.base);
+#if BUDDY_STATS
+    //Each arena peaks at two halves, but never all of them at once
+    size_t half = UINT64_C(1) << (MIN_K - 1);
+    void *ptrs[6];
+    for (int i = 0; i < 5; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, half - sizeof(struct avail));
+        TEST_ASSERT_NOT_NULL(ptrs[i]);
+    }
+    TEST_ASSERT_EQUAL(2, buddy_arena_count(&pool));
+    buddy_free(&pool, ptrs[2]);
+    ptrs[2] = NULL;
+    ptrs[5] = buddy_malloc(&pool, half - sizeof(struct avail));
+    TEST_ASSERT_NOT_NULL(ptrs[5]);
+
+    struct buddy_stats st;
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(5 * half, st.alloc_bytes);
+    TEST_ASSERT_EQUAL(5 * half, st.peak_bytes);
+    for (int i = 0; i < 6; i++)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(0, st.alloc_bytes);
+    TEST_ASSERT_EQUAL(5 * half, st.peak_bytes);
+#endif
+    buddy_destroy(&pool);
+}
+
+static void *thread_cache_worker(void *arg)
+{
+    struct buddy_pool *pool = arg;
+    size_t half = (UINT64_C(1) << (MIN_K - 1)) - sizeof(struct avail);
+    void *ptrs[6];
+    for (int i = 0; i < 6; i++)
+    {
+        ptrs[i] = buddy_malloc(pool, half);
+    }
+    for (int i = 0; i < 6; i++)
+    {
+        buddy_free(pool, ptrs[i]);
+    }
+    return NULL;
+}
+
+void test_growable_thread_cache(void) {
+    fprintf(stderr, "->Testing arenas emptied by a thread cache flush are released\n");
+    struct buddy_pool pool;
+    struct buddy_init_opts opts = {
+        .size = UINT64_C(1) << MIN_K,
+        .flags = BUDDY_GROWABLE | BUDDY_THREAD_CACHE,
+    };
+    buddy_init_ex(&pool, &opts);
+    TEST_ASSERT_NOT_NULL(pool.base);
+    //Cache the half-pool blocks so freeing them leaves the arenas in use
+    buddy_thread_cache_config(&pool, MIN_K - 1, 16);
+
+    size_t half = (UINT64_C(1) << (MIN_K - 1)) - sizeof(struct avail);
+    void *ptrs[6];
+    for (int i = 0; i < 6; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, half);
+        TEST_ASSERT_NOT_NULL(ptrs[i]);
+    }
+    TEST_ASSERT_EQUAL(2, buddy_arena_count(&pool));
+    for (int i = 0; i < 6; i++)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    TEST_ASSERT_EQUAL(2, buddy_arena_count(&pool));
+
+    //Once flushed both arenas are free and all but the spare go
+    buddy_thread_cache_flush(&pool);
+    TEST_ASSERT_EQUAL(1, buddy_arena_count(&pool));
+    check_buddy_pool_full(&pool);
+
+    //A thread that exits with a full cache flushes it on the way out
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_cache_worker, &pool);
+    pthread_join(thread, NULL);
+    TEST_ASSERT_EQUAL(1, buddy_arena_count(&pool));
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_malloc_batch(void) {
+    fprintf(stderr, "->Testing batch allocation of siblings\n");
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+    //Ten 256 byte blocks carved side by side out of one split
+    void *out[16];
+    TEST_ASSERT_EQUAL(10, buddy_malloc_batch(&pool, 200, 10, out));
+    for (int i = 0; i < 10; i++)
+    {
+        TEST_ASSERT_EQUAL_PTR((char *)pool.base + i * 256 + sizeof(struct avail), out[i]);
+        TEST_ASSERT_EQUAL(8, ((struct avail *)out[i] - 1)->kval);
+        memset(out[i], i, 100);
+    }
+    check_meta(&pool);
+    check_avail_bits(&pool);
+
+    //The leftover units of the split went back as the fewest blocks
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_AVAIL, 9), pool.meta[(10 * 256) >> SMALLEST_K]);
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_AVAIL, 12), pool.meta[(16 * 256) >> SMALLEST_K]);
+
+    for (int i = 0; i < 10; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(i, ((char *)out[i])[99]);
+        buddy_free(&pool, out[i]);
+    }
+    check_buddy_pool_full(&pool);
+
+    //Only two half-pool blocks fit, the rest is reported as missing
+    errno = 0;
+    size_t half = (UINT64_C(1) << (MIN_K - 1)) - sizeof(struct avail);
+    TEST_ASSERT_EQUAL(2, buddy_malloc_batch(&pool, half, 5, out));
+    TEST_ASSERT_EQUAL(ENOMEM, errno);
+    check_buddy_pool_empty(&pool);
+    buddy_free(&pool, out[0]);
+    buddy_free(&pool, out[1]);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+
+    //Headerless siblings are exactly the requested size apart
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_HEADERLESS);
+    TEST_ASSERT_EQUAL(16, buddy_malloc_batch(&pool, 4096, 16, out));
+    for (int i = 0; i < 16; i++)
+    {
+        TEST_ASSERT_EQUAL_PTR((char *)pool.base + i * 4096, out[i]);
+    }
+    check_meta(&pool);
+    for (int i = 0; i < 16; i++)
+    {
+        buddy_free(&pool, out[i]);
+    }
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_free_batch(void) {
+    fprintf(stderr, "->Testing batch free with bottom-up coalescing\n");
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_SLAB);
+
+    //Blocks of mixed sizes and tiny slab objects, handed back in a
+    //shuffled order with a few holes
+    void *ptrs[96];
+    unsigned seed = 7;
+    for (int i = 0; i < 96; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, (i % 3 == 0) ? 16 : (size_t)(rand_r(&seed) % 3000) + 1);
+        TEST_ASSERT_NOT_NULL(ptrs[i]);
+    }
+    for (int i = 95; i > 0; i--)
+    {
+        int j = rand_r(&seed) % (i + 1);
+        void *tmp = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+    void *held[2] = { ptrs[40], ptrs[70] };
+    ptrs[40] = NULL;
+    ptrs[70] = NULL;
+
+    //Free a third one by one first so the batch also merges with blocks
+    //that are already on the lists
+    for (int i = 0; i < 32; i++)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    buddy_free_batch(&pool, ptrs + 32, 64);
+    check_meta(&pool);
+    check_avail_bits(&pool);
+    buddy_free_batch(&pool, held, 2);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+
+    //A pool emptied in a single batch coalesces back to one block
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    for (int i = 0; i < 64; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, 200);
+    }
+    buddy_free_batch(&pool, ptrs, 64);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+
+    //Pointers from the extra arenas of a growable pool go home too
+    struct buddy_init_opts opts = { .size = UINT64_C(1) << MIN_K, .flags = BUDDY_GROWABLE };
+    buddy_init_ex(&pool, &opts);
+    size_t half = (UINT64_C(1) << (MIN_K - 1)) - sizeof(struct avail);
+    TEST_ASSERT_EQUAL(8, buddy_malloc_batch(&pool, half, 8, ptrs));
+    TEST_ASSERT_EQUAL(3, buddy_arena_count(&pool));
+    buddy_free_batch(&pool, ptrs, 8);
+    TEST_ASSERT_EQUAL(1, buddy_arena_count(&pool));
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_lazy(void) {
+    fprintf(stderr, "->Testing lazy coalescing\n");
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_LAZY);
+
+    //A freed block is parked, not merged, and comes straight back
+    char *p = buddy_malloc(&pool, 100);
+    size_t before = pool_free_bytes(&pool);
+    buddy_free(&pool, p);
+    TEST_ASSERT_EQUAL(1, pool.lazy_count[7]);
+    TEST_ASSERT_EQUAL(before, pool_free_bytes(&pool));
+    TEST_ASSERT_EQUAL_UINT8(BLOCK_META(BLOCK_RESERVED, 7), pool.meta[0]);
+    TEST_ASSERT_EQUAL_PTR(p, buddy_malloc(&pool, 100));
+    TEST_ASSERT_EQUAL(0, pool.lazy_count[7]);
+    TEST_ASSERT_EQUAL(before, pool_free_bytes(&pool));
+
+    //Crossing the high-water mark coalesces the oldest half
+    buddy_lazy_config(&pool, 4);
+    char *ptrs[10];
+    ptrs[0] = p;
+    for (int i = 1; i < 10; i++)
+    {
+        ptrs[i] = buddy_malloc(&pool, 100);
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        buddy_free(&pool, ptrs[i]);
+        TEST_ASSERT_TRUE(pool.lazy_count[7] <= 4);
+    }
+    TEST_ASSERT_EQUAL(4, pool.lazy_count[7]);
+    check_meta(&pool);
+    check_avail_bits(&pool);
+
+    //A request nothing on the lists can satisfy coalesces everything first
+    size_t half = (UINT64_C(1) << (MIN_K - 1)) - sizeof(struct avail);
+    char *a = buddy_malloc(&pool, half);
+    char *b = buddy_malloc(&pool, half);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    TEST_ASSERT_EQUAL(0, pool.lazy_count[7]);
+    buddy_free(&pool, a);
+    buddy_free(&pool, b);
+    TEST_ASSERT_EQUAL(2, pool.lazy_count[MIN_K - 1]);
+
+    buddy_coalesce(&pool);
+    TEST_ASSERT_EQUAL(0, pool.lazy_count[MIN_K - 1]);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_stats(void) {
+    fprintf(stderr, "->Testing pool statistics\n");
+    struct buddy_pool pool;
+    struct buddy_stats st;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+    //A fresh pool is one free block
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(MIN_K, st.largest_free_k);
+    TEST_ASSERT_EQUAL(0.0, st.fragmentation);
+#if BUDDY_STATS
+    TEST_ASSERT_EQUAL(1, st.free_blocks[MIN_K]);
+    TEST_ASSERT_EQUAL(UINT64_C(1) << MIN_K, st.free_bytes);
+    TEST_ASSERT_EQUAL(0, st.alloc_bytes);
+
+    //One small block splits the pool all the way down
+    char *a = buddy_malloc(&pool, 100);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(MIN_K - 7, st.splits);
+    TEST_ASSERT_EQUAL(1, st.alloc_blocks[7]);
+    TEST_ASSERT_EQUAL(128, st.alloc_bytes);
+    TEST_ASSERT_EQUAL(100, st.requested_bytes);
+    TEST_ASSERT_EQUAL(128, st.reserved_bytes);
+    TEST_ASSERT_EQUAL(MIN_K - 1, st.largest_free_k);
+    for (size_t k = 7; k < MIN_K; k++)
+    {
+        TEST_ASSERT_EQUAL(1, st.free_blocks[k]);
+    }
+    TEST_ASSERT_TRUE(st.fragmentation > 0.0 && st.fragmentation < 0.5);
+    check_stats(&pool);
+
+    //Shrinking and growing in place count as splits and merges too
+    a = buddy_realloc(&pool, a, 1000);
+    check_stats(&pool);
+    a = buddy_realloc(&pool, a, 10);
+    check_stats(&pool);
+
+    //A batch, a failure and the peak
+    void *ptrs[32];
+    TEST_ASSERT_EQUAL(32, buddy_malloc_batch(&pool, 200, 32, ptrs));
+    size_t peak = 32 * 256 + 64;
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(peak, st.peak_bytes);
+    TEST_ASSERT_NULL(buddy_malloc(&pool, UINT64_C(1) << MIN_K));
+    TEST_ASSERT_NULL(buddy_malloc(&pool, 0));
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(1, st.failures);
+    check_stats(&pool);
+
+    //Freeing everything coalesces back to where we started
+    buddy_free_batch(&pool, ptrs, 32);
+    buddy_free(&pool, a);
+    buddy_stats(&pool, &st);
+    TEST_ASSERT_EQUAL(0, st.alloc_bytes);
+    TEST_ASSERT_EQUAL(peak, st.peak_bytes);
+    TEST_ASSERT_EQUAL(st.splits, st.coalesces);
+    TEST_ASSERT_EQUAL(1, st.free_blocks[MIN_K]);
+    TEST_ASSERT_EQUAL(33, st.mallocs);
+    TEST_ASSERT_EQUAL(33, st.frees);
+    check_stats(&pool);
+#endif
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+static size_t read_trace(const char *path, struct buddy_trace_header *hdr,
+                         struct buddy_trace_record *recs, size_t max)
+{
+    FILE *f = fopen(path, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(1, fread(hdr, sizeof(*hdr), 1, f));
+    size_t n = fread(recs, sizeof(*recs), max, f);
+    fclose(f);
+    return n;
+}
+
+void test_live_stats(void) {
+    fprintf(stderr, "->Testing live requested and reserved bytes\n");
+    unsigned flags[] = { 0, BUDDY_HEADERLESS, BUDDY_SLAB | BUDDY_CONCURRENT, BUDDY_THREAD_CACHE };
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++)
+    {
+        struct buddy_pool pool;
+        buddy_init_flags(&pool, UINT64_C(1) << MIN_K, flags[f]);
+        TEST_ASSERT_NOT_NULL(pool.base);
+#if BUDDY_STATS
+        struct buddy_stats st;
+        size_t hdr = (flags[f] & BUDDY_HEADERLESS) ? 0 : sizeof(struct avail);
+        char *a = buddy_malloc(&pool, 3000);
+        char *b = buddy_malloc(&pool, 5000);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(8000, st.live_requested_bytes);
+        TEST_ASSERT_EQUAL(4096 + 8192, st.live_reserved_bytes);
+
+        //Resizing in place, within the block, shrinking and growing
+        a = buddy_realloc(&pool, a, 3500);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(8500, st.live_requested_bytes);
+        b = buddy_realloc(&pool, b, 1000);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(4500, st.live_requested_bytes);
+        TEST_ASSERT_EQUAL(4096 + 1024, st.live_reserved_bytes);
+        b = buddy_realloc(&pool, b, 2000 - hdr);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(5500 - hdr, st.live_requested_bytes);
+        TEST_ASSERT_EQUAL(4096 + 2048, st.live_reserved_bytes);
+
+        //Freed blocks drop out, the lifetime totals keep them
+        buddy_free(&pool, a);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(2000 - hdr, st.live_requested_bytes);
+        TEST_ASSERT_EQUAL(2048, st.live_reserved_bytes);
+        TEST_ASSERT_EQUAL(3000 + 5000, st.requested_bytes);
+
+        //Tiny objects and a batch
+        char *tiny[3] = { buddy_malloc(&pool, 5), buddy_malloc(&pool, 12), buddy_malloc(&pool, 20) };
+        void *batch[20];
+        TEST_ASSERT_EQUAL(20, buddy_malloc_batch(&pool, 100, 20, batch));
+        buddy_stats(&pool, &st);
+        size_t tiny_reserved = (flags[f] & BUDDY_SLAB) ? 8 + 16 + 32 : 3 * 64;
+        TEST_ASSERT_EQUAL(2000 - hdr + 37 + 20 * 100, st.live_requested_bytes);
+        TEST_ASSERT_EQUAL(2048 + tiny_reserved + 20 * 128, st.live_reserved_bytes);
+        buddy_free_batch(&pool, batch, 20);
+        for (int i = 0; i < 3; i++)
+        {
+            buddy_free(&pool, tiny[i]);
+        }
+        buddy_free(&pool, b);
+        buddy_stats(&pool, &st);
+        TEST_ASSERT_EQUAL(0, st.live_requested_bytes);
+        TEST_ASSERT_EQUAL(0, st.live_reserved_bytes);
+#endif
+        buddy_thread_cache_flush(&pool);
+        check_buddy_pool_full(&pool);
+        buddy_destroy(&pool);
+    }
+}
+
+void test_trace(void) {
+    fprintf(stderr, "->Testing the allocation trace recorder\n");
+    char path[] = "/tmp/buddy-trace-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    TEST_ASSERT_EQUAL(0, buddy_trace_start(&pool, path, 0));
+    TEST_ASSERT_EQUAL(EBUSY, buddy_trace_start(&pool, path, 0));
+
+    //Every public call leaves exactly one record, realloc included
+    char *a = buddy_malloc(&pool, 100);
+    char *b = buddy_realloc(&pool, a, 5000);
+    void *c = buddy_aligned_alloc(&pool, 4096, 10);
+    TEST_ASSERT_NULL(buddy_malloc(&pool, UINT64_C(1) << MIN_K));
+    buddy_free(&pool, b);
+    buddy_free(&pool, c);
+    TEST_ASSERT_EQUAL(0, buddy_trace_stop(&pool));
+    TEST_ASSERT_EQUAL(0, buddy_trace_stop(&pool));
+
+    struct buddy_trace_header hdr;
+    struct buddy_trace_record recs[16];
+    size_t n = read_trace(path, &hdr, recs, 16);
+    TEST_ASSERT_EQUAL_UINT64(BUDDY_TRACE_MAGIC, hdr.magic);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_VERSION, hdr.version);
+    TEST_ASSERT_EQUAL(sizeof(struct buddy_trace_record), hdr.record_size);
+    TEST_ASSERT_EQUAL(pool.numbytes, hdr.pool_bytes);
+    TEST_ASSERT_EQUAL(6, n);
+
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_MALLOC, recs[0].op);
+    TEST_ASSERT_EQUAL((uintptr_t)a, recs[0].id);
+    TEST_ASSERT_EQUAL(100, recs[0].size);
+    TEST_ASSERT_EQUAL(7, recs[0].order);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_REALLOC, recs[1].op);
+    TEST_ASSERT_EQUAL((uintptr_t)b, recs[1].id);
+    TEST_ASSERT_EQUAL((uintptr_t)a, recs[1].old_id);
+    TEST_ASSERT_EQUAL(13, recs[1].order);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_ALIGNED, recs[2].op);
+    TEST_ASSERT_EQUAL(4096, recs[2].old_id);
+    TEST_ASSERT_EQUAL(12, recs[2].order);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_MALLOC, recs[3].op);
+    TEST_ASSERT_EQUAL(0, recs[3].id);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_FREE, recs[4].op);
+    TEST_ASSERT_EQUAL((uintptr_t)b, recs[4].id);
+    TEST_ASSERT_EQUAL(13, recs[4].order);
+    TEST_ASSERT_EQUAL(BUDDY_TRACE_FREE, recs[5].op);
+    for (size_t i = 1; i < n; i++)
+    {
+        TEST_ASSERT_TRUE(recs[i].ts_ns >= recs[i - 1].ts_ns);
+    }
+
+    //A ring too small to keep up drops records instead of blocking, and
+    //every call is either written or counted as dropped
+    TEST_ASSERT_EQUAL(0, buddy_trace_start(&pool, path, 4));
+    for (int i = 0; i < 1000; i++)
+    {
+        buddy_free(&pool, buddy_malloc(&pool, 64));
+    }
+    uint64_t dropped = buddy_trace_stop(&pool);
+    static struct buddy_trace_record many[2000];
+    n = read_trace(path, &hdr, many, 2000);
+    TEST_ASSERT_EQUAL(2000, n + dropped);
+
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+    unlink(path);
+}
+
+#if BUDDY_LATENCY
+static void *latency_worker(void *arg)
+{
+    struct buddy_pool *pool = arg;
+    for (int i = 0; i < 1000; i++)
+    {
+        buddy_free(pool, buddy_malloc(pool, 100));
+    }
+    return NULL;
+}
+#endif
+
+void test_latency(void) {
+    fprintf(stderr, "->Testing per-operation latency histograms\n");
+    struct buddy_pool pool;
+    struct buddy_latency h;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_CONCURRENT);
+#if BUDDY_LATENCY
+    TEST_ASSERT_EQUAL(0, buddy_latency_start(&pool));
+    TEST_ASSERT_EQUAL(EBUSY, buddy_latency_start(&pool));
+    TEST_ASSERT_TRUE(buddy_latency_cycles_per_ns() > 0.0);
+
+    //Each pair splits the pool all the way down and merges it back up
+    for (int i = 0; i < 100; i++)
+    {
+        buddy_free(&pool, buddy_malloc(&pool, 100));
+    }
+    buddy_latency_read(&pool, BUDDY_LAT_MALLOC, 7, &h);
+    TEST_ASSERT_EQUAL(100, h.count);
+    TEST_ASSERT_EQUAL(100, h.split_depth[MIN_K - 7]);
+    TEST_ASSERT_EQUAL(100, h.coalesce_depth[0]);
+    TEST_ASSERT_TRUE(h.max > 0 && h.cycles >= h.max);
+    uint64_t p50 = buddy_latency_percentile(&h, 0.50);
+    uint64_t p99 = buddy_latency_percentile(&h, 0.99);
+    TEST_ASSERT_TRUE(p50 <= p99 && p99 <= h.max);
+    buddy_latency_read(&pool, BUDDY_LAT_FREE, 7, &h);
+    TEST_ASSERT_EQUAL(100, h.count);
+    TEST_ASSERT_EQUAL(100, h.coalesce_depth[MIN_K - 7]);
+
+    //A realloc that grows in place lands in the order it grew to and a
+    //failure is not timed at all
+    char *a = buddy_malloc(&pool, 100);
+    a = buddy_realloc(&pool, a, 5000);
+    buddy_latency_read(&pool, BUDDY_LAT_REALLOC, 13, &h);
+    TEST_ASSERT_EQUAL(1, h.count);
+    TEST_ASSERT_EQUAL(1, h.coalesce_depth[13 - 7]);
+    TEST_ASSERT_NULL(buddy_malloc(&pool, UINT64_C(1) << MIN_K));
+    buddy_latency_read(&pool, BUDDY_LAT_MALLOC, 0, &h);
+    TEST_ASSERT_EQUAL(0, h.count);
+    buddy_free(&pool, a);
+
+    //Threads that have exited still count, their histograms are reused
+    for (int round = 0; round < 2; round++)
+    {
+        pthread_t threads[2];
+        for (int t = 0; t < 2; t++)
+        {
+            pthread_create(&threads[t], NULL, latency_worker, &pool);
+        }
+        for (int t = 0; t < 2; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    buddy_latency_read(&pool, BUDDY_LAT_MALLOC, BUDDY_LAT_ALL_ORDERS, &h);
+    TEST_ASSERT_EQUAL(100 + 1 + 4000, h.count);
+    uint64_t total = 0;
+    for (size_t b = 0; b < BUDDY_LAT_BUCKETS; b++)
+    {
+        total += h.buckets[b];
+    }
+    TEST_ASSERT_EQUAL(h.count, total);
+
+    buddy_latency_stop(&pool);
+    buddy_latency_read(&pool, BUDDY_LAT_MALLOC, BUDDY_LAT_ALL_ORDERS, &h);
+    TEST_ASSERT_EQUAL(0, h.count);
+#else
+    TEST_ASSERT_EQUAL(ENOTSUP, buddy_latency_start(&pool));
+    buddy_latency_read(&pool, BUDDY_LAT_MALLOC, BUDDY_LAT_ALL_ORDERS, &h);
+    TEST_ASSERT_EQUAL(0, h.count);
+#endif
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+void test_publish(void) {
+    fprintf(stderr, "->Testing the shared memory stats page\n");
+    struct buddy_pool pool;
+    buddy_init_flags(&pool, UINT64_C(1) << MIN_K, BUDDY_CONCURRENT);
+    char name[64];
+    snprintf(name, sizeof(name), "/buddy-test.%ld", (long)getpid());
+    TEST_ASSERT_EQUAL(EINVAL, buddy_publish_start(&pool, "no-slash", 10));
+    TEST_ASSERT_EQUAL(0, buddy_publish_start(&pool, name, 10));
+    TEST_ASSERT_EQUAL(EBUSY, buddy_publish_start(&pool, name, 10));
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+    const struct buddy_shm_page *page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    TEST_ASSERT_TRUE(page != MAP_FAILED);
+    TEST_ASSERT_EQUAL_UINT64(BUDDY_SHM_MAGIC, page->magic);
+    TEST_ASSERT_EQUAL(BUDDY_SHM_VERSION, page->version);
+    TEST_ASSERT_EQUAL(sizeof(struct buddy_shm_page), page->page_size);
+    TEST_ASSERT_EQUAL(getpid(), page->pid);
+    TEST_ASSERT_EQUAL(pool.numbytes, page->pool_bytes);
+    TEST_ASSERT_TRUE(page->updates >= 1);
+
+    //Later snapshots pick up the allocation
+    char *a = buddy_malloc(&pool, 100);
+    uint64_t updates = __atomic_load_n(&page->updates, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&page->updates, __ATOMIC_ACQUIRE) < updates + 2)
+    {
+        usleep(1000);
+    }
+    uint64_t seq;
+    do
+    {
+        seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+    } while (seq & 1);
+#if BUDDY_STATS
+    TEST_ASSERT_EQUAL(128, page->stats.alloc_bytes);
+    TEST_ASSERT_EQUAL(1, page->stats.alloc_blocks[7]);
+    TEST_ASSERT_EQUAL(1, page->stats.mallocs);
+#endif
+    TEST_ASSERT_EQUAL(MIN_K - 1, page->stats.largest_free_k);
+    munmap((void *)page, sizeof(*page));
+
+    //Stopping removes the page
+    buddy_free(&pool, a);
+    buddy_publish_stop(&pool);
+    TEST_ASSERT_TRUE(shm_open(name, O_RDONLY, 0) < 0);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+static __attribute__((noinline)) void heap_profile_alloc(struct buddy_pool *pool, void **ptrs, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        ptrs[i] = buddy_malloc(pool, 64);
+    }
+}
+
+/* Reads the header totals of a heap profile, and whether a stack has pc in [lo, hi) */
+static bool read_heap_profile(const char *path, unsigned long long totals[4], uintptr_t lo, uintptr_t hi)
+{
+    FILE *f = fopen(path, "r");
+    TEST_ASSERT_NOT_NULL(f);
+    char line[8192];
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), f));
+    unsigned long long interval = 0;
+    TEST_ASSERT_EQUAL(5, sscanf(line, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu",
+                                &totals[0], &totals[1], &totals[2], &totals[3], &interval));
+    TEST_ASSERT_EQUAL(1, interval);
+    bool found = false;
+    bool maps = false;
+    while (fgets(line, sizeof(line), f))
+    {
+        maps = maps || strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+        for (char *at = strstr(line, " 0x"); !maps && at; at = strstr(at + 1, " 0x"))
+        {
+            uintptr_t pc = (uintptr_t)strtoull(at + 1, NULL, 16);
+            found = found || (pc >= lo && pc < hi);
+        }
+    }
+    fclose(f);
+    TEST_ASSERT_TRUE(maps);
+    return found;
+}
+
+void test_heap_profile(void) {
+    fprintf(stderr, "->Testing the sampling heap profiler\n");
+    char path[] = "/tmp/buddy-heap-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << MIN_K);
+    TEST_ASSERT_EQUAL(EINVAL, buddy_heap_profile_dump(&pool, path));
+    TEST_ASSERT_EQUAL(0, buddy_heap_profile_start(&pool, 1));
+    TEST_ASSERT_EQUAL(EBUSY, buddy_heap_profile_start(&pool, 1));
+
+    //With a one byte interval every allocation after the thread's first
+    //is sampled, and kept only until it is freed
+    buddy_free(&pool, buddy_malloc(&pool, 64));
+    void *ptrs[100];
+    heap_profile_alloc(&pool, ptrs, 100);
+    for (size_t i = 0; i < 100; i += 2)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    unsigned long long totals[4];
+    uintptr_t fn = (uintptr_t)heap_profile_alloc;
+    TEST_ASSERT_EQUAL(0, buddy_heap_profile_dump(&pool, path));
+    TEST_ASSERT_TRUE(read_heap_profile(path, totals, fn, fn + 4096));
+    TEST_ASSERT_EQUAL(50, totals[0]);
+    TEST_ASSERT_EQUAL(50 * 64, totals[1]);
+    TEST_ASSERT_TRUE(totals[2] >= 100);
+
+    //A realloc trades the old sample for one of the new size
+    ptrs[1] = buddy_realloc(&pool, ptrs[1], 1000);
+    void *batch[8];
+    TEST_ASSERT_EQUAL(8, buddy_malloc_batch(&pool, 32, 8, batch));
+    TEST_ASSERT_EQUAL(0, buddy_heap_profile_dump(&pool, path));
+    read_heap_profile(path, totals, 0, 0);
+    TEST_ASSERT_EQUAL(58, totals[0]);
+    TEST_ASSERT_EQUAL(49 * 64 + 1000 + 8 * 32, totals[1]);
+
+    buddy_free_batch(&pool, batch, 8);
+    for (size_t i = 1; i < 100; i += 2)
+    {
+        buddy_free(&pool, ptrs[i]);
+    }
+    TEST_ASSERT_EQUAL(0, buddy_heap_profile_dump(&pool, path));
+    read_heap_profile(path, totals, 0, 0);
+    TEST_ASSERT_EQUAL(0, totals[0]);
+    TEST_ASSERT_EQUAL(0, totals[1]);
+
+    buddy_heap_profile_stop(&pool);
+    TEST_ASSERT_EQUAL(EINVAL, buddy_heap_profile_dump(&pool, path));
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+    unlink(path);
+}
+
 int main(void) {
     time_t t;
     unsigned seed = (unsigned)time(&t);
@@ -451,6 +1952,7 @@ int main(void) {
     
     // New tests
     RUN_TEST(test_btok_edge_cases);
+    RUN_TEST(test_btok_matches_loop);
     RUN_TEST(test_buddy_calc_edge_cases);
     RUN_TEST(test_buddy_malloc_edge_cases);
     RUN_TEST(test_buddy_realloc);
@@ -463,6 +1965,34 @@ int main(void) {
     RUN_TEST(test_realloc_edge_cases);
     RUN_TEST(test_mmap_failure);
     RUN_TEST(test_realloc_content);
+    RUN_TEST(test_avail_bits);
+    RUN_TEST(test_meta_side_table);
+    RUN_TEST(test_headerless);
+    RUN_TEST(test_slab);
+    RUN_TEST(test_aligned_alloc);
+    RUN_TEST(test_base_alignment);
+    RUN_TEST(test_realloc_in_place);
+    RUN_TEST(test_purge);
+    RUN_TEST(test_init_ex);
+    RUN_TEST(test_growable);
+    RUN_TEST(test_growable_oversized);
+    RUN_TEST(test_growable_peak);
+    RUN_TEST(test_growable_thread_cache);
+    RUN_TEST(test_malloc_batch);
+    RUN_TEST(test_free_batch);
+    RUN_TEST(test_lazy);
+    RUN_TEST(test_stats);
+    RUN_TEST(test_live_stats);
+    RUN_TEST(test_trace);
+    RUN_TEST(test_latency);
+    RUN_TEST(test_publish);
+    RUN_TEST(test_heap_profile);
+    RUN_TEST(test_concurrent_stress);
+    RUN_TEST(test_thread_cache);
+    RUN_TEST(test_thread_cache_stress);
+    RUN_TEST(test_slab_stress);
+    RUN_TEST(test_growable_stress);
+    RUN_TEST(test_lazy_stress);
     
     return UNITY_END();
 }
\ No newline at end of file